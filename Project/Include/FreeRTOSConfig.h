@@ -73,15 +73,30 @@
  *----------------------------------------------------------*/
 
 #define configUSE_PREEMPTION		1
-#define configUSE_IDLE_HOOK			0
+#define configUSE_IDLE_HOOK			1
+	/* The I2C stress test submits from the tick hook (see i2cStress.c) */
+#if defined(I2C_STRESS) && (I2C_STRESS == 1)
+#define configUSE_TICK_HOOK			1
+#else
 #define configUSE_TICK_HOOK			0
+#endif
 	/* 14.7456MHz crystal multiplied by 4 using the NXP LPC2103 PLL */
 #define configCPU_CLOCK_HZ			( ( unsigned portLONG ) 58982400 )
 #define configTICK_RATE_HZ			( ( portTickType ) 1000 )
 #define configMAX_PRIORITIES		( ( unsigned portBASE_TYPE ) 5 )
 #define configMINIMAL_STACK_SIZE	( ( unsigned portSHORT ) 128 )
-	/* 5 KB heap, adjust as needed */
-#define configTOTAL_HEAP_SIZE		( ( size_t ) ( 5 * 1024 ) )
+	/* 3.5 KB heap, sized for the 8 KB RAM (see LPC2103-rom.ld)
+	 * - 5 tasks (I2C, LED, CAM, AE, idle) at 68 + 520 bytes each
+	 * - 3 queues/semaphores at 96 bytes each
+	 * = 3228 bytes
+	 * The I2C_MEASURE build also holds vI2C_MeasureCompletion's helper task
+	 * and queue while it runs (3912 bytes at the peak): 4 KB
+	 */
+#if defined(I2C_MEASURE) && (I2C_MEASURE == 1)
+#define configTOTAL_HEAP_SIZE		( ( size_t ) ( 4 * 1024 ) )
+#else
+#define configTOTAL_HEAP_SIZE		( ( size_t ) ( 3584 ) )
+#endif
 #define configMAX_TASK_NAME_LEN		( 8 )
 #define configUSE_TRACE_FACILITY	0
 #define configUSE_16_BIT_TICKS		0
@@ -95,9 +110,9 @@
 /* Set the following definitions to 1 to include the API function, or zero
 to exclude the API function. */
 
-#define INCLUDE_vTaskPrioritySet		0
-#define INCLUDE_uxTaskPriorityGet		0
-#define INCLUDE_vTaskDelete				0
+#define INCLUDE_vTaskPrioritySet		1
+#define INCLUDE_uxTaskPriorityGet		1
+#define INCLUDE_vTaskDelete				1
 #define INCLUDE_vTaskCleanUpResources	0
 #define INCLUDE_vTaskSuspend			0
 #define INCLUDE_vTaskDelayUntil			0
@@ -4,13 +4,363 @@
 #ifndef CAM_H_
 #define CAM_H_
 
+/* Camera register table (see ucCAM_LoadTable)
+ *
+ * A const table in flash, one entry per register write or delay, ending
+ * with CAM_END. Runs of consecutive registers are written as one
+ * auto-increment burst.
+ */
+typedef struct xCAM_Reg
+{
+	unsigned portCHAR ucOp;			/* CAM_OP_* */
+	unsigned portCHAR ucReg;		/* Register (CAM_OP_WRITE) */
+	unsigned portCHAR ucVal;		/* Value (CAM_OP_WRITE) or delay in
+									   ticks (CAM_OP_DELAY) */
+} xCAM_Reg;
+
+#define CAM_OP_WRITE	0x00
+#define CAM_OP_DELAY	0x01
+#define CAM_OP_END		0x02
+
+#define CAM_REG(reg, val)	{ CAM_OP_WRITE, (reg), (val) }
+#define CAM_DELAY(ticks)	{ CAM_OP_DELAY, 0x00, (ticks) }
+#define CAM_END				{ CAM_OP_END, 0x00, 0x00 }
+
+/* Camera readiness (see ucCAM_WaitReady)
+ * - the camera is probed by reading its product ID register until it
+ *   answers with CAM_PID, backing off from CAM_READY_FIRST to
+ *   CAM_READY_BACKOFF ticks between probes, for at most CAM_READY_MAX
+ *   ticks
+ * - xCamBoot times the bring-up in ticks from the scheduler start
+ */
+#define CAM_PID_REG			0x0A
+#define CAM_PID				0x76
+#define CAM_READY_FIRST		5
+#define CAM_READY_BACKOFF	20
+#define CAM_READY_PROBE		35		/* ticks, longest wait for one probe */
+#ifndef CAM_READY_MAX
+#define CAM_READY_MAX		1000
+#endif
+
+typedef struct xCAM_BootReport
+{
+	portTickType xReady;			/* Camera answered */
+	portTickType xLoaded;			/* Register table written */
+	portTickType xFirstFrame;		/* First line of the first frame */
+	unsigned portSHORT usProbes;	/* ID reads until the camera answered */
+	unsigned portCHAR ucReady;		/* pdFALSE: CAM_READY_MAX ran out */
+} xCAM_BootReport;
+
+extern xCAM_BootReport xCamBoot;
+
+/* Register table load report */
+typedef struct xCAM_LoadReport
+{
+	portTickType xTicks;			/* Bring-up time, delays included */
+	unsigned portSHORT usRegs;		/* Registers written */
+	unsigned portSHORT usBursts;	/* I2C transactions used */
+	unsigned portSHORT usErrors;	/* Failed bursts */
+} xCAM_LoadReport;
+
+extern xCAM_LoadReport xCamLoad;
+
+/* Camera capture port
+ * - D[7:0]: P0.16 - P0.23 (read as FIO0PIN2)
+ * - VSYNC:  P0.10 = CAP1.0 (rising edge = start of frame)
+ * - HREF:   P0.11 = CAP1.1 (high while a line is output)
+ * - PCLK:   P0.12 (GPIO, data valid on the rising edge)
+ */
+#define camVSYNC_PIN	0x00000400
+#define camHREF_PIN		0x00000800
+#define camPCLK_PIN		0x00001000
+
+/* Line buffers (ping-pong)
+ * - CAM_LINE_MAX bytes each, e.g. one QQVGA YUV422 line (160 x 2)
+ * - together with ucCamCode these are most of cam.c's RAM; the heap was
+ *   cut to make room (see FreeRTOSConfig.h)
+ */
+#define CAM_LINE_BUFFERS	2
+#define CAM_LINE_MAX		320
+
+/* Capture window (see ucCAM_SetWindow)
+ *
+ * Region of interest and integer decimation, applied by the capture ISR
+ * while pixels arrive: pixels and lines outside the window, or dropped by
+ * decimation, are never stored. Coordinates are in sensor pixels and lines
+ * before decimation; a pixel is CAM_PIXEL_BYTES bytes on the data port.
+ * - one pixel of every ucHDec and one line of every ucVDec is kept,
+ *   starting at (usX, usY)
+ * - with YUV422 output an even ucHDec keeps the same chroma byte (U or V)
+ *   in every pixel; use an odd factor to keep both
+ */
+#define CAM_PIXEL_BYTES		2
+
+typedef struct xCAM_Window
+{
+	unsigned portSHORT usX;			/* First pixel */
+	unsigned portSHORT usY;			/* First line */
+	unsigned portSHORT usWidth;		/* Pixels */
+	unsigned portSHORT usHeight;	/* Lines */
+	unsigned portCHAR ucHDec;		/* Horizontal decimation, 1 = none */
+	unsigned portCHAR ucVDec;		/* Vertical decimation, 1 = none */
+} xCAM_Window;
+
+/* Window as used by the capture ISR (derived by ucCAM_SetWindow) */
+typedef struct xCAM_Crop
+{
+	unsigned portSHORT usSkip;		/* Bytes before the first pixel kept */
+	unsigned portSHORT usGap;		/* Bytes skipped between pixels kept */
+	unsigned portSHORT usOut;		/* Bytes kept per line */
+	unsigned portSHORT usTop;		/* First line */
+	unsigned portSHORT usBottom;	/* Last line + 1 */
+	unsigned portCHAR ucVDec;
+} xCAM_Crop;
+
+#define camLINE_FREE	0x00	/* Can be filled by the ISR */
+#define camLINE_READY	0x01	/* Filled, waiting for the consumer */
+#define camLINE_HELD	0x02	/* Being processed by the consumer */
+
+/* Capture ISR time bound
+ * - a line is read in the capture ISR with IRQs masked, which holds off
+ *   the tick, I2C0, the bus watchdog and EINT2 for as long as it runs
+ * - the ISR stops reading once it has run for CAM_IRQ_MAX_US: the line is
+ *   delivered short (the rest of it is lost) and counted in ulCut
+ * - CAM_IRQ_MAX is the same bound in Pclk (Timer1) cycles; keep it well
+ *   below one tick
+ */
+#define CAM_IRQ_MAX_US		500
+#define CAM_IRQ_MAX			((configCPU_CLOCK_HZ / 1000000) * CAM_IRQ_MAX_US)
+
+/* Capture report
+ * - ulIrqLast / ulIrqMax: Pclk cycles the capture ISR ran (IRQs masked)
+ *   for the last line read / the longest so far
+ * - ulPhaseLost: lines dropped because the byte position the ISR started
+ *   sampling at could not be worked out (see prvCAM_ReadLine)
+ */
+typedef struct xCAM_CaptureStats
+{
+	unsigned portLONG ulFrames;		/* VSYNCs seen */
+	unsigned portLONG ulLines;		/* Lines captured */
+	unsigned portLONG ulDropped;	/* Lines lost, no free line buffer */
+	unsigned portLONG ulLineRate;	/* Lines captured in the last second */
+	unsigned portLONG ulBytes;		/* Bytes stored in line buffers */
+	unsigned portLONG ulIrqLast;	/* ISR cycles, last line */
+	unsigned portLONG ulIrqMax;		/* ISR cycles, longest line */
+	unsigned portLONG ulCut;		/* Lines cut short at CAM_IRQ_MAX */
+	unsigned portLONG ulPhaseLost;	/* Lines dropped, position unknown */
+} xCAM_CaptureStats;
+
+extern xCAM_CaptureStats xCamCapture;
+
+/* Line compression (see camCodec.c)
+ * - a coded line is at most CAM_CODE_MAX bytes, header included
+ * - CAM_CODE_RAW in the header marks a line stored uncoded
+ * - xCamCodec counts the bytes and cost of coding; usRatio and usCycles
+ *   are worked out over each second by vCAMTask
+ */
+#define CAM_CODE_MAX	(CAM_LINE_MAX + 1)
+#define CAM_CODE_RAW	0xFF
+
+typedef struct xCAM_CodecStats
+{
+	unsigned portLONG ulLines;		/* Lines coded */
+	unsigned portLONG ulRaw;		/* Bytes in */
+	unsigned portLONG ulCode;		/* Bytes out */
+	unsigned portLONG ulCycles;		/* CPU cycles spent coding */
+	unsigned portSHORT usRatio;		/* Bytes in / bytes out x 100 */
+	unsigned portSHORT usCycles;	/* CPU cycles per pixel */
+} xCAM_CodecStats;
+
+extern xCAM_CodecStats xCamCodec;
+
+/* Frame-synchronous register writes (see ucCAM_SyncWrite)
+ *
+ * Writes are held until the next VSYNC and then written as one batch at
+ * the start of vertical blanking, so that a frame never straddles a
+ * change. A register written twice before the VSYNC is written once, with
+ * the last value.
+ * - ulFit / ulOverrun: batches that did / did not complete within the
+ *   measured blanking interval (xCAM_Timing.ulBlank)
+ * - ulDeferred: VSYNCs at which the previous batch was still being written
+ *   (the held writes wait for the next VSYNC)
+ * - ulLast: Pclk cycles from VSYNC to the end of the last batch
+ */
+#define CAM_SYNC_MAX	8
+
+typedef struct xCAM_SyncReport
+{
+	unsigned portLONG ulBatches;
+	unsigned portLONG ulWrites;		/* I2C transactions */
+	unsigned portLONG ulBytes;		/* Bytes on the bus (address, register
+									   and data) */
+	unsigned portLONG ulFit;
+	unsigned portLONG ulOverrun;
+	unsigned portLONG ulDeferred;
+	unsigned portLONG ulFull;		/* Writes refused, CAM_SYNC_MAX held */
+	unsigned portLONG ulErrors;		/* Failed writes */
+	unsigned portLONG ulLast;
+} xCAM_SyncReport;
+
+extern xCAM_SyncReport xCamSync;
+
+/* Camera configuration profiles (see ucCAM_SetProfile)
+ *
+ * A profile is a const register table (CAM_REG entries in ascending
+ * register order, CAM_END last) for one camera mode. Profiles should list
+ * the same registers: a switch writes only the registers whose value in
+ * the target differs from the active profile, at the next VSYNC, as part
+ * of the frame-synchronous batch. The active profile changes when that
+ * batch has been written.
+ */
+typedef struct xCAM_Profile
+{
+	const signed portCHAR *pcName;
+	const xCAM_Reg *pxRegs;
+} xCAM_Profile;
+
+extern const xCAM_Profile xCamProfilePreview;
+extern const xCAM_Profile xCamProfileCapture;
+extern const xCAM_Profile xCamProfileLowPower;
+
+/* Last profile switch
+ * - usRegs, usBytes, usWrites: registers changed, bus bytes and I2C
+ *   transactions (runs of consecutive registers are written as bursts)
+ * - ulCycles: Pclk cycles from the VSYNC to the end of the batch
+ * - ucFit: pdTRUE if that was within the blanking interval
+ */
+typedef struct xCAM_ProfileReport
+{
+	const xCAM_Profile *pxFrom;		/* NULL: camera state not known */
+	const xCAM_Profile *pxTo;
+	unsigned portSHORT usRegs;
+	unsigned portSHORT usBytes;
+	unsigned portSHORT usWrites;
+	unsigned portCHAR ucFit;
+	unsigned portLONG ulCycles;
+	unsigned portLONG ulSwitches;	/* Switches completed */
+} xCAM_ProfileReport;
+
+extern xCAM_ProfileReport xCamProfile;
+
+/* Auto-exposure report (see camAE.c)
+ * - usConvFrames / xConvTicks: frames and ticks the last convergence took,
+ *   from the first frame out of tolerance to aeSETTLE frames within it
+ * - usLoad: CPU used by the statistics and the controller, in 1/1000ths
+ *   (I2C writes not included), from ulStatCycles + ulCtrlCycles; each of
+ *   these is written by one task only
+ */
+typedef struct xCAM_AEReport
+{
+	unsigned portCHAR ucMean;		/* Mean luminance, last frame */
+	unsigned portCHAR ucGain;		/* Gain in 1/16ths (16 = 1x) */
+	unsigned portSHORT usExposure;	/* Exposure in lines */
+	unsigned portSHORT usConvFrames;
+	portTickType xConvTicks;
+	unsigned portLONG ulConverged;	/* Convergences */
+	unsigned portLONG ulFrames;		/* Frames measured */
+	unsigned portLONG ulErrors;		/* Writes not queued (xCamSync) */
+	unsigned portLONG ulStatCycles;	/* CPU cycles, statistics (CAM task) */
+	unsigned portLONG ulCtrlCycles;	/* CPU cycles, control (AE task) */
+	unsigned portSHORT usLoad;
+} xCAM_AEReport;
+
+extern xCAM_AEReport xCamAE;
+
+/* Frame / line timing (see vCAM_GetTiming)
+ *
+ * VSYNC and HREF rising edges are timestamped by the Timer1 capture
+ * hardware (T1CR0 / T1CR1), so interrupt latency does not show up in the
+ * measurements. All periods are in Pclk cycles (configCPU_CLOCK_HZ).
+ * - ulAvg and ulJitter are rolling (1/CAM_TIMING_WEIGHT) averages of the
+ *   period and of its absolute deviation from ulAvg
+ * - ulMin / ulMax since the last vCAM_ResetTiming()
+ */
+#define CAM_TIMING_SHIFT	3
+#define CAM_TIMING_WEIGHT	(1 << CAM_TIMING_SHIFT)
+
+typedef struct xCAM_Period
+{
+	unsigned portLONG ulLast;		/* Last period measured */
+	unsigned portLONG ulAvg;		/* Rolling average period */
+	unsigned portLONG ulJitter;		/* Rolling average |period - ulAvg| */
+	unsigned portLONG ulMin;
+	unsigned portLONG ulMax;
+	unsigned portLONG ulSamples;	/* Periods measured */
+} xCAM_Period;
+
+typedef struct xCAM_Timing
+{
+	xCAM_Period xFrame;				/* VSYNC to VSYNC */
+	xCAM_Period xLine;				/* HREF to HREF, same frame */
+	unsigned portSHORT usLines;		/* HREFs in the last complete frame */
+	unsigned portLONG ulBlank;		/* VSYNC to first HREF, last frame */
+	unsigned portLONG ulPclk;		/* PCLK period x 256, 0 = not measured
+									   (see prvCAM_ReadLine) */
+} xCAM_Timing;
+
 /* Function prototypes */
 void vStartCAMTask( unsigned portBASE_TYPE uxPriority );
 void vCAMTask( void* pvParameters __attribute__ ((unused)));
 void vCAM_Init( void );
+unsigned portCHAR ucCAM_LoadTable( const xCAM_Reg *pxTable );
+unsigned portCHAR ucCAM_WaitReady( portTickType xMaxWait );
+
+/* Pixel clock (XCLK on MAT2.0, see ulCAM_SetPixelClock) */
+unsigned portLONG ulCAM_SetPixelClock( unsigned portLONG ulHz,
+									   unsigned portCHAR ucDuty,
+									   portBASE_TYPE xAtFrame );
+unsigned portLONG ulCAM_PixelClock( void );
+void vCAM_FrameBoundary( void );
+
+/* Line capture */
+void vCAM_StartCapture( void );
+void vCAM_StopCapture( void );
+unsigned portCHAR *pucCAM_WaitLine( portTickType xTicksToWait,
+									unsigned portSHORT *pusLine,
+									unsigned portSHORT *pusLen );
+void vCAM_ReleaseLine( unsigned portCHAR *pucLine );
+unsigned portCHAR ucCAM_SetWindow( const xCAM_Window *pxWindow );
+
+/* Line compression, runs from RAM (long_call: out of BL range of flash) */
+unsigned portSHORT usCAM_Compress( const unsigned portCHAR *pucLine,
+								   unsigned portSHORT usLen,
+								   unsigned portCHAR *pucCode )
+								   __attribute__ ((long_call));
+
+/* Frame-synchronous register writes */
+unsigned portCHAR ucCAM_SyncWrite( unsigned portCHAR ucReg,
+								   unsigned portCHAR ucVal );
+unsigned portCHAR ucCAM_SyncWriteN( const xCAM_Reg *pxRegs,
+									unsigned portCHAR ucCount );
+void vCAM_SyncFlush( unsigned portLONG ulVsyncAt );
+
+/* Configuration profiles */
+unsigned portCHAR ucCAM_SetProfile( const xCAM_Profile *pxProfile );
+const xCAM_Profile *pxCAM_GetProfile( void );
+unsigned portSHORT usCAM_ProfileDelta( const xCAM_Profile *pxFrom,
+									   const xCAM_Profile *pxTo );
+
+/* Auto-exposure */
+void vStartAETask( unsigned portBASE_TYPE uxPriority );
+void vAETask( void* pvParameters __attribute__ ((unused)));
+void vCAM_AELine( const unsigned portCHAR *pucLine,
+				  unsigned portSHORT usLine,
+				  unsigned portSHORT usLen );
+
+/* Frame timing */
+void vCAM_GetTiming( xCAM_Timing *pxTiming );
+void vCAM_ResetTiming( void );
+unsigned portLONG ulCAM_FrameRate( void );
 
 /* Defines for CAM task */
 /* Requestor IDs for shared queues */
 #define CAM_REQID      0x1
 
+/* Default camera pixel clock (XCLK) */
+#define CAM_XCLK_HZ    12000000
+#define CAM_XCLK_DUTY  50
+
+/* Camera SCCB slave address (7-bit, OmniVision write address 0x42) */
+#define CAM_SCCB_ADDR  0x21
+
 #endif /* CAM_H_ */
@@ -0,0 +1,34 @@
+/************
+ * cycles.h *
+ ************
+ * Pclk cycle stamps for measuring short code paths
+ *
+ * The FreeRTOS tick timer (Timer0, see port.c) counts Pclk cycles
+ * (Pclk = Cclk = 58.9824 MHz) from 0 up to T0MR0 and then resets once per
+ * tick. Two stamps taken less than one tick (1 ms) apart therefore give
+ * the elapsed number of cycles, even across a tick boundary.
+ *
+ * Usage:
+ *
+ * 		ulStart = ulCYCLES_NOW();
+ * 		...code being measured...
+ * 		ulCycles = ulCyclesSince(ulStart);
+ */
+#ifndef CYCLES_H
+#define CYCLES_H
+
+#define ulCYCLES_NOW()	((unsigned portLONG) READ(T0TC))
+
+#define ulCYCLES_ELAPSED(ulStart, ulEnd) 									\
+	( ((ulEnd) >= (ulStart)) ? ((ulEnd) - (ulStart)) :						\
+	  ((ulEnd) + (unsigned portLONG) READ(T0MR0) + 1 - (ulStart)) )
+
+/* Cycles elapsed since ulStart (T0TC is read exactly once) */
+static inline unsigned portLONG ulCyclesSince( unsigned portLONG ulStart )
+{
+	unsigned portLONG ulEnd = ulCYCLES_NOW();
+
+	return ulCYCLES_ELAPSED(ulStart, ulEnd);
+}
+
+#endif /* CYCLES_H */
@@ -14,6 +14,66 @@
 #define I2C_WriteWord		0x05	/* Word write with a "command" byte */
 #define I2C_ReadWord		0x06	/* Word read with a "command" byte */
 
+/* Driver-level opcodes. These are NOT SMBus transactions and are executed
+ * entirely inside the I2C engine (see vI2CTask).
+ */
+#define I2C_Scan			0x10	/* Quick-write probe of an address range */
+#define I2C_WriteBurst		0x11	/* Command byte followed by pucBuf[]
+									   (register auto-increment, no SMBus
+									   byte count) */
+
+/* Bus scan parameters
+ * - the presence map holds one bit per 7-bit address (128 bits)
+ * - map[addr >> 3] bit (addr & 0x07) = 1 if the address ACK'd
+ * - addresses 0x00-0x07 and 0x78-0x7F are reserved by the I2C
+ *   specification and are normally excluded from a scan
+ */
+#define I2C_SCAN_MAP_SIZE	0x10
+#define I2C_SCAN_FIRST		0x08
+#define I2C_SCAN_LAST		0x77
+
+/* Bus watchdog limits (SMBus tTIMEOUT, min and max) */
+#define I2C_TIMEOUT_US		25000
+#define I2C_TIMEOUT_MAX_US	35000
+
+/* SMBus events (see ucI2C_SetEventHandler)
+ * - I2C_EVENT_ALERT: the device asserted SMBALERT# (EINT2); data is the
+ *   byte it returned from the Alert Response Address
+ * - I2C_EVENT_NOTIFY: the device sent Host Notify to I2C_HOST_ADDR; data
+ *   is the 16-bit status word it sent
+ */
+#define I2C_ARA_ADDR		0x0C	/* SMBus Alert Response Address */
+#define I2C_HOST_ADDR		0x08	/* SMBus Host address */
+#define I2C_EVENT_ALERT		0x01
+#define I2C_EVENT_NOTIFY	0x02
+#define I2C_EVENT_HANDLERS	0x04
+
+typedef void (*pxI2C_EventHandler)( unsigned portCHAR addr,
+									unsigned portCHAR event,
+									unsigned portSHORT data );
+
+/* Request descriptor pool
+ * - I2C_POOL_SIZE descriptors are statically allocated by i2c.c
+ * - a task may hold several pool descriptors in flight at once
+ */
+#ifndef I2C_POOL_SIZE
+#define I2C_POOL_SIZE		0x04
+#endif
+
+/* Request descriptor flags */
+#define I2C_FLAG_POOL		0x01	/* Descriptor belongs to the pool */
+#define I2C_FLAG_RELEASE	0x02	/* Engine returns the descriptor to the
+									   pool on completion (no completion is
+									   signalled to the requesting task) */
+#define I2C_FLAG_DEADLINE	0x04	/* xDeadline is valid: the request is
+									   scheduled earliest-deadline-first and
+									   failed with I2C_EXPIRED if it cannot
+									   be started before xDeadline */
+#define I2C_FLAG_ENGINE		0x08	/* Queued from engine context with
+									   ucI2C_Continue(), or from an ISR with
+									   ucI2C_SubmitFromISR() (holds no
+									   request queue slot) */
+
 /* I2C transactions state symbols. These are used in the I2C ISR to track
  * the I2C transaction state.
  */
@@ -25,6 +85,8 @@
 #define I2C_WR_COUNT		0x18
 #define I2C_COMMAND			0x20
 #define I2C_QUICK			0x21
+#define I2C_SCAN_NEXT		0x22
+#define I2C_SLAVE			0x30
 #define I2C_RD_ADDR 		0x40
 #define I2C_RD_ADDR_ACK		0x41
 #define I2C_RD_DATA_ACK 	0x42
@@ -32,8 +94,143 @@
 #define	I2C_RD_COUNT		0x48
 #define I2C_LOST_ARB		0x80
 #define I2C_ERROR_STOP		0xF0
+#define I2C_TIMEOUT			0xF1	/* Bus watchdog expired, bus recovered */
+#define I2C_EXPIRED			0xF2	/* Deadline passed before it was started */
+#define I2C_CANCELLED		0xF3	/* Cancelled by the requester */
+#define I2C_QUEUE_FULL		0xF4	/* Request queue full, nothing queued */
 #define I2C_ERROR			0xFF
 
+/* I2C completion signal
+ * - owned by a requesting task and shared by all of its request descriptors
+ *   (xI2C_struct.pxHandle points to it)
+ * - the engine sets the request's "done" flag and directly wakes the task
+ *   blocked in ucI2C_Wait(); no queue storage or item copy is involved
+ * - one task per signal (only the highest priority waiter is woken)
+ */
+typedef struct xI2C_Signal
+{
+	xList xWaiters;					/* Task blocked waiting for completion */
+} xI2C_Signal;
+
+/* Completion cost measurement (build with I2C_MEASURE = 1)
+ * - I2C_MEASURE = 1: vI2C_MeasureCompletion() is built and run once by
+ *   vCAMTask at start-up; its helper task and queue need the larger heap
+ *   (see FreeRTOSConfig.h)
+ * - I2C_MEASURE = 0: only ulEngineSignal is recorded
+ */
+#ifndef I2C_MEASURE
+#define I2C_MEASURE			0
+#endif
+
+/* Completion cost report (see vI2C_MeasureCompletion)
+ * - Pclk cycles for the "signal" and "wait" halves of one completion when
+ *   no task is blocked, for a FreeRTOS queue and for xI2C_Signal
+ * - Pclk cycles from the signal to the woken task running, with a higher
+ *   priority task blocked on the queue / on the xI2C_Signal (the event
+ *   list removal and the context switch included)
+ * - RAM used by one xI2C_Signal (a queue also needs an xQUEUE from the
+ *   heap plus the heap block header)
+ * - engine cycles for the most recent real completion (including the wake)
+ */
+typedef struct xI2C_CompletionCost
+{
+	unsigned portLONG ulQueueSignal;	/* xQueueSendToBack() */
+	unsigned portLONG ulQueueWait;		/* xQueueReceive() */
+	unsigned portLONG ulFlagSignal;		/* done flag + direct wake */
+	unsigned portLONG ulFlagWait;		/* ucI2C_Wait() */
+	unsigned portLONG ulQueueWake;		/* xQueueSendToBack() to the
+										   xQueueReceive() task running */
+	unsigned portLONG ulFlagWake;		/* prvI2C_Signal() to the
+										   ucI2C_Wait() task running */
+	unsigned portLONG ulFlagRAM;		/* sizeof(xI2C_Signal) */
+	unsigned portLONG ulEngineSignal;	/* Last completion in vI2CTask */
+} xI2C_CompletionCost;
+
+/* Request queue admission (see ucI2C_SubmitWait)
+ * - at most I2C_QUEUE_DEPTH requests can be queued (submitted but not yet
+ *   started by the engine); further submissions wait or fail with
+ *   I2C_QUEUE_FULL
+ * - xI2C_Queue reports the queue depth for sizing I2C_QUEUE_DEPTH
+ */
+#ifndef I2C_QUEUE_DEPTH
+#define I2C_QUEUE_DEPTH		0x08
+#endif
+
+typedef struct xI2C_QueueStats
+{
+	unsigned portBASE_TYPE uxDepth;		/* Requests queued now */
+	unsigned portBASE_TYPE uxPeak;		/* Highest uxDepth seen */
+	unsigned portLONG ulWaits;			/* Submitters blocked on a full queue */
+	unsigned portLONG ulFull;			/* Submissions failed, I2C_QUEUE_FULL */
+} xI2C_QueueStats;
+
+extern xI2C_QueueStats xI2C_Queue;
+
+/* Engine priority inheritance
+ * - I2C_INHERIT = 1: the engine runs at the priority of the highest-priority
+ *   task with a request queued or in flight (never below the priority given
+ *   to vStartI2CTask)
+ * - I2C_INHERIT = 0: the engine keeps the priority given to vStartI2CTask
+ * - the vStartI2CTask priority is the floor for work fed from interrupts
+ *   (ucI2C_SubmitFromISR, bus watchdog recovery, SMBus events), which
+ *   cannot raise the engine; keep it at or above the highest priority
+ *   task that depends on such work
+ */
+#ifndef I2C_INHERIT
+#define I2C_INHERIT			1
+#endif
+
+/* Bus bandwidth budgets (see ucI2C_SetBudget)
+ * - up to I2C_BUDGETS requesters (reqID) can hold a reservation of bus time
+ *   per I2C_BUDGET_PERIOD ticks; requesters without one are not limited
+ * - a requester that has used up its budget is held back at dispatch until
+ *   the next period (an overrun is paid back from the next period)
+ */
+#ifndef I2C_BUDGETS
+#define I2C_BUDGETS			0x04
+#endif
+#define I2C_BUDGET_PERIOD	100		/* ticks */
+
+typedef struct xI2C_BudgetReport
+{
+	unsigned portCHAR reqID;
+	unsigned portLONG ulReserved;		/* us per period */
+	unsigned portLONG ulConsumed;		/* us used in the current period */
+	unsigned portLONG ulLastConsumed;	/* us used in the last full period */
+	unsigned portLONG ulDeferred;		/* Dispatch passes that held back
+										   a request */
+} xI2C_BudgetReport;
+
+/* Prepared transaction (see ucI2C_Execute)
+ *
+ * A fixed access (opcode, slave address, command byte) that is described
+ * once, as a const object in flash, and performed any number of times:
+ *
+ *	static const xI2C_Prepared xGain = I2C_PREPARE(I2C_WriteByte, 0x21, 0x00);
+ *	ucI2C_Execute(pxI2C, &xGain, ucGain);
+ *
+ * To submit one without waiting, point pxI2C->pxPrepared at it, fill in
+ * pxI2C->data[] and call ucI2C_Submit(); while pxPrepared is set the
+ * request's own opcode, addr and comm are not used.
+ */
+typedef struct xI2C_Prepared
+{
+	unsigned portCHAR opcode;		/* I2C transaction opcode */
+	unsigned portCHAR addr;			/* Slave address of I2C device */
+	unsigned portCHAR comm;			/* Command byte (or last scan address) */
+} xI2C_Prepared;
+
+#define I2C_PREPARE(opcode, addr, comm)	{ (opcode), (addr), (comm) }
+
+/* Completion handler (see ucI2C_Continue)
+ * - runs in the I2C engine task right after the request completes, with
+ *   pxI2C->status set; it must not block
+ * - returns pdFALSE to complete the request to its requester as usual, or
+ *   pdTRUE if it has kept the request (e.g. continued it)
+ */
+struct xI2C_struct;
+typedef portBASE_TYPE (*pxI2C_CompleteHandler)( struct xI2C_struct *pxI2C );
+
 /* I2C transaction parameter structure
  * - initialized by the requesting task including write data (if any)
  * - returns completion status and read data (if any)
@@ -41,8 +238,13 @@
 typedef struct xI2C_struct
 {
 	unsigned portCHAR reqID;		/* ID of requesting task */
-	void * pxHandle;				/* Task-specific completion queue handle */
+	unsigned portCHAR flags;		/* Request descriptor flags (I2C_FLAG_*) */
+	void * pxHandle;				/* Task-specific completion signal
+									   (xI2C_Signal *) */
 	unsigned portCHAR status;		/* I2C transaction completion status */
+	volatile unsigned portCHAR done;/* Set by the engine on completion */
+	volatile unsigned portCHAR cancel;
+									/* Set by ucI2C_Cancel() */
 	unsigned portCHAR opcode;		/* I2C transaction opcode
 										0: Quick Command
 										1: Send Byte
@@ -61,12 +263,41 @@ typedef struct xI2C_struct
 	unsigned portCHAR data[0x02];	/* Contains write data (for writes) or
 									   read data (for reads)
 									 */
+	unsigned portCHAR *pucBuf;		/* Caller-owned buffer for driver-level
+									   opcodes
+										- I2C_Scan: presence map
+										  (I2C_SCAN_MAP_SIZE bytes)
+										- I2C_WriteBurst: write data
+									 */
+	unsigned portCHAR ucBufLen;		/* I2C_WriteBurst: bytes in pucBuf */
+	const xI2C_Prepared *pxPrepared;/* Prepared access, or NULL to use
+									   opcode, addr and comm above */
+	pxI2C_CompleteHandler pxComplete;
+									/* Completion handler, or NULL */
+	void *pvContext;				/* Completion handler's own state */
+	portTickType xDeadline;			/* Absolute deadline in ticks
+									   (xTaskGetTickCount() time base),
+									   used if I2C_FLAG_DEADLINE is set */
+	unsigned portCHAR ucPriority;	/* Requesting task's priority */
+	unsigned portLONG ulQueued;		/* Timer3 time of submission */
+	struct xI2C_struct * volatile pxNext;
+									/* Request queue / pool free list link */
 } xI2C_struct;
 
 /* Function Prototypes */
-void vI2C_Init( unsigned portBASE_TYPE uxQueueLength );
+void vI2C_Init( void );
 void vStartI2CTask( unsigned portBASE_TYPE uxPriority );
 void vI2CTask( void* pvParameters __attribute__ ((unused)));
+void vI2C_SetTimeout( unsigned portLONG ulMicroseconds );
+
+/* SCCB (OmniVision camera bus) devices */
+void vI2C_SetSCCB( unsigned portCHAR addr, portBASE_TYPE xEnable );
+
+/* SMBus event handling (SMBALERT# and Host Notify) */
+unsigned portCHAR ucI2C_SetEventHandler( unsigned portCHAR addr,
+										 pxI2C_EventHandler pxHandler );
+void vI2C_EnableAlert( void );
+void vI2C_EnableHostNotify( void );
 
 
 unsigned portCHAR ucI2C_Quick (xI2C_struct *pxI2C,
@@ -98,4 +329,48 @@ unsigned portCHAR ucI2C_ReadWord (xI2C_struct *pxI2C,
 		                          unsigned portCHAR addr,
                                   unsigned portCHAR cmd);
 
+unsigned portCHAR ucI2C_WriteBurst (xI2C_struct *pxI2C,
+									unsigned portCHAR addr,
+									unsigned portCHAR cmd,
+									unsigned portCHAR *pucData,
+									unsigned portCHAR len);
+
+unsigned portCHAR ucI2C_Scan (xI2C_struct *pxI2C,
+							  unsigned portCHAR first,
+							  unsigned portCHAR last,
+							  unsigned portCHAR *pucMap);
+
+unsigned portCHAR ucI2C_Execute (xI2C_struct *pxI2C,
+								 const xI2C_Prepared *pxPrepared,
+								 unsigned portBASE_TYPE data);
+
+/* Completion signalling */
+void vI2C_SignalInit (xI2C_Signal *pxSignal);
+unsigned portCHAR ucI2C_Wait (xI2C_struct *pxI2C, portTickType xTicksToWait);
+#if I2C_MEASURE == 1
+void vI2C_MeasureCompletion (void);
+#endif
+
+/* Request descriptor pool
+ *
+ * A pool descriptor is filled in by the requesting task (opcode, addr, comm,
+ * data) and queued with ucI2C_Submit(), which does not wait. The task then
+ * waits for each of its requests with ucI2C_Wait(); the completion signal
+ * given to pxI2C_Alloc() is shared by all of them.
+ */
+xI2C_struct *pxI2C_Alloc (unsigned portCHAR reqID, void *pxHandle);
+void vI2C_Release (xI2C_struct *pxI2C);
+unsigned portCHAR ucI2C_Submit (xI2C_struct *pxI2C);
+unsigned portCHAR ucI2C_SubmitWait (xI2C_struct *pxI2C,
+									portTickType xTicksToWait);
+unsigned portCHAR ucI2C_Cancel (xI2C_struct *pxI2C);
+unsigned portCHAR ucI2C_Continue (xI2C_struct *pxI2C);
+unsigned portCHAR ucI2C_SubmitFromISR (xI2C_struct *pxI2C);
+
+/* Bus bandwidth budgets */
+unsigned portCHAR ucI2C_SetBudget (unsigned portCHAR reqID,
+								   unsigned portLONG ulMicroseconds);
+unsigned portCHAR ucI2C_GetBudget (unsigned portCHAR reqID,
+								   xI2C_BudgetReport *pxReport);
+
 #endif /*I2C_H_*/
@@ -0,0 +1,59 @@
+/***************
+ * i2cStress.h *
+ ***************
+ * Include file for i2cStress.c, the I2C submission stress test
+ */
+#ifndef I2C_STRESS_H
+#define I2C_STRESS_H
+
+/* Submission stress test (see i2cStress.c, build with I2C_STRESS = 1)
+ * - I2C_STRESS_TASKS submitter tasks, the lowest below and the others above
+ *   the engine's priority, each keep I2C_STRESS_DEPTH requests in flight,
+ *   and the tick hook submits one more with ucI2C_SubmitFromISR() every
+ *   I2C_STRESS_ISR_TICKS ticks
+ * - every request reads register I2C_STRESS_COMM of I2C_STRESS_ADDR; an
+ *   absent device only changes the status, every request must still
+ *   complete exactly once
+ * - the stress build replaces the camera (see Makefile)
+ */
+#ifndef I2C_STRESS
+#define I2C_STRESS			0
+#endif
+#define I2C_STRESS_TASKS	2
+#define I2C_STRESS_DEPTH	2
+#define I2C_STRESS_ISR_TICKS	3
+#define I2C_STRESS_TIMEOUT	500		/* ticks */
+#define I2C_STRESS_ADDR		0x21
+#define I2C_STRESS_COMM		0x0A
+
+/* Stress counters per submitter (tasks first, then the tick hook); each
+ * field has a single writer
+ * - ulLost: the request came back done without the engine completing it
+ * - ulStranded: the request was not back within I2C_STRESS_TIMEOUT ticks
+ *   (a task submitter then keeps waiting for it)
+ */
+typedef struct xI2C_StressSource
+{
+	unsigned portLONG ulSubmitted;
+	unsigned portLONG ulCompleted;
+	unsigned portLONG ulLost;
+	unsigned portLONG ulStranded;
+} xI2C_StressSource;
+
+typedef struct xI2C_StressReport
+{
+	xI2C_StressSource xSource[I2C_STRESS_TASKS + 1];
+	unsigned portLONG ulCompletions;	/* Completion handler runs */
+	unsigned portLONG ulDuplicate;		/* Completions of a request that
+										   was not in flight, or completed
+										   twice for one submission */
+	unsigned portLONG ulErrors;			/* Status other than I2C_STOP
+										   (informational) */
+} xI2C_StressReport;
+
+extern xI2C_StressReport xI2C_Stress;
+
+/* Function prototypes */
+void vStartI2CStress( void );
+
+#endif /* I2C_STRESS_H */
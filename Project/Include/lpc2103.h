@@ -111,7 +111,7 @@
 #define MONTH			(*((volatile unsigned char *) 0xE0024038))
 
 #define PCON			(*((volatile unsigned long *) 0xE01FC0C0))
-#define PCONP			(*((volatile unsigned long *) 0xE014C0C4))
+#define PCONP			(*((volatile unsigned long *) 0xE01FC0C4))
 #define PINSEL0			(*((volatile unsigned long *) 0xE002C000))
 #define PINSEL1			(*((volatile unsigned long *) 0xE002C004))
 #define PLLCFG			(*((volatile unsigned long *) 0xE01FC084))
@@ -5,6 +5,8 @@
 /* FreeRTOS includes */
 #include "FreeRTOS.h"
 #include "task.h"
+#include "queue.h"
+#include "semphr.h"
 
 /* Project includes */
 #include "lpc2103.h"
@@ -14,11 +16,209 @@
 /* Project defines */
 #define camSTACK_SIZE ((unsigned portSHORT) configMINIMAL_STACK_SIZE)
 
+/* Longest auto-increment burst written by ucCAM_LoadTable (1 = no
+ * coalescing, for sensors without register auto-increment)
+ */
+#define camBURST_MAX	16
+
+/* Timer2 power control bit, PCONP[22] */
+#define camPCONP_TIMER2	0x00400000
+
+/* VIC channel 5 (Timer1) bit, the VSYNC/HREF capture interrupt */
+#define camVIC_TIMER1	0x00000020
+
+/* Function prototypes */
+static portBASE_TYPE prvCAM_SyncDone( xI2C_struct *pxI2C );
+static unsigned portCHAR prvCAM_SyncStep( xI2C_struct *pxI2C );
+static unsigned portCHAR prvCAM_SyncFind( unsigned portCHAR ucReg );
+static unsigned portCHAR prvCAM_ProfileNeeds( const xCAM_Profile *pxFrom,
+											  const xCAM_Reg *pxReg );
+
 /* Global variables */
 
 /* Queue variables for I2C */
 xI2C_struct xCamI2C;
 static xI2C_struct *pxCamI2C;
+static xI2C_Signal xCamSignal;
+
+/* Register table loader
+ * - ucCamBurst collects a run of consecutive registers (one burst)
+ * - xCamLoad reports the last table load
+ */
+static unsigned portCHAR ucCamBurst[camBURST_MAX];
+xCAM_LoadReport xCamLoad;
+
+/* Pixel clock
+ * - ulCamXclkPeriod is the current XCLK period in Pclk cycles
+ * - ulCamNextMR0/MR1 hold a retune waiting for the next frame boundary
+ *   (ucCamRetune = pdTRUE)
+ */
+static unsigned portLONG ulCamXclkPeriod;
+static unsigned portLONG ulCamNextMR0;
+static unsigned portLONG ulCamNextMR1;
+static volatile unsigned portCHAR ucCamRetune;
+
+/* Line capture (see camISR.c)
+ * - the ISR fills a FREE line buffer and marks it READY; the consumer
+ *   holds it (HELD) while processing and then frees it
+ * - ulCamLineSeq orders READY buffers, usCamLineNum is the line number
+ *   within the frame
+ * - xCamLineSemaphore is given by the ISR for every line captured
+ */
+xSemaphoreHandle xCamLineSemaphore;
+unsigned portCHAR ucCamLine[CAM_LINE_BUFFERS][CAM_LINE_MAX];
+volatile unsigned portCHAR ucCamLineState[CAM_LINE_BUFFERS];
+unsigned portSHORT usCamLineLen[CAM_LINE_BUFFERS];
+unsigned portSHORT usCamLineNum[CAM_LINE_BUFFERS];
+unsigned portLONG ulCamLineSeq[CAM_LINE_BUFFERS];
+unsigned portCHAR ucCamFill;
+unsigned portSHORT usCamLine;
+xCAM_CaptureStats xCamCapture;
+
+/* Capture window
+ * - xCamCrop is used by the ISR; ucCAM_SetWindow() leaves a new window in
+ *   xCamCropNext which is taken at the next VSYNC (or capture start) so a
+ *   frame is never captured with two windows
+ * - ucCamVPhase counts lines within the window for vertical decimation
+ * - the default is the whole line, up to CAM_LINE_MAX bytes
+ */
+xCAM_Crop xCamCrop = { 0, 0, CAM_LINE_MAX, 0, 0xFFFF, 1 };
+xCAM_Crop xCamCropNext;
+volatile unsigned portCHAR ucCamCropPending;
+unsigned portCHAR ucCamVPhase;
+
+/* Line compression
+ * - ucCamCode holds the last coded line, for the link to send
+ */
+unsigned portCHAR ucCamCode[CAM_CODE_MAX];
+unsigned portSHORT usCamCodeLen;
+xCAM_CodecStats xCamCodec;
+
+/* Frame / line timing, updated by the ISR
+ * - ulCamVsyncAt / ulCamHrefAt are the last captured edges (T1TC)
+ * - ucCamTimed: bit 0 = ulCamVsyncAt valid, bit 1 = ulCamHrefAt valid
+ *   for this frame
+ */
+xCAM_Timing xCamTiming;
+unsigned portLONG ulCamVsyncAt;
+unsigned portLONG ulCamHrefAt;
+unsigned portCHAR ucCamTimed;
+
+/* Frame-synchronous register writes
+ * - xCamSyncHeld: writes waiting for the next VSYNC (task side, under a
+ *   critical section against the ISR)
+ * - xCamSyncBatch: the batch being written, one request (xCamSyncI2C)
+ *   stepped through it by its completion handler; ucCamSyncBusy is set
+ *   from the VSYNC that starts it until its last write completes
+ */
+static xCAM_Reg xCamSyncHeld[CAM_SYNC_MAX];
+static unsigned portCHAR ucCamSyncHeld;
+static xCAM_Reg xCamSyncBatch[CAM_SYNC_MAX];
+static unsigned portCHAR ucCamSyncLen;
+static unsigned portCHAR ucCamSyncNext;
+static volatile unsigned portCHAR ucCamSyncBusy;
+static unsigned portLONG ulCamSyncAt;
+xI2C_struct xCamSyncI2C;
+xCAM_SyncReport xCamSync;
+
+/* Configuration profiles
+ * - pxCamProfile is the active profile (NULL until the first switch: the
+ *   camera state is then not known and the whole target is written)
+ * - pxCamProfileNext is a switch waiting for the next VSYNC
+ * - pxCamSyncFrom / pxCamSyncTo / usCamSyncPos: the switch in the batch
+ *   being written, stepped through by prvCAM_SyncStep
+ * - ucCamSyncBurst holds the data of a burst of consecutive registers
+ */
+static const xCAM_Profile * volatile pxCamProfile;
+static const xCAM_Profile * volatile pxCamProfileNext;
+static const xCAM_Profile *pxCamSyncFrom;
+static const xCAM_Profile *pxCamSyncTo;
+static unsigned portSHORT usCamSyncPos;
+static unsigned portCHAR ucCamSyncBurst[camBURST_MAX];
+xCAM_ProfileReport xCamProfile;
+
+/* Bring-up timing */
+xCAM_BootReport xCamBoot;
+
+/* Camera bring-up register table (OmniVision, YUV422 VGA defaults)
+ * - the reset is followed by a delay before the sensor is accessed again
+ * - consecutive registers are listed in ascending order so that the loader
+ *   can write them as bursts
+ */
+static const xCAM_Reg xCamInit[] =
+{
+	CAM_REG(0x12, 0x80),	/* COM7: reset all registers */
+	CAM_DELAY(2),
+	CAM_REG(0x11, 0x01),	/* CLKRC: internal clock = XCLK / 2 */
+	CAM_REG(0x12, 0x00),	/* COM7: YUV output */
+	CAM_REG(0x0C, 0x00),	/* COM3 */
+	CAM_REG(0x3E, 0x00),	/* COM14 */
+	CAM_REG(0x17, 0x13),	/* HSTART */
+	CAM_REG(0x18, 0x01),	/* HSTOP */
+	CAM_REG(0x19, 0x02),	/* VSTRT */
+	CAM_REG(0x1A, 0x7A),	/* VSTOP */
+	CAM_REG(0x32, 0xB6),	/* HREF */
+	CAM_REG(0x03, 0x0A),	/* VREF */
+	CAM_REG(0x70, 0x3A),	/* SCALING_XSC */
+	CAM_REG(0x71, 0x35),	/* SCALING_YSC */
+	CAM_REG(0x72, 0x11),	/* SCALING_DCWCTR */
+	CAM_REG(0x73, 0xF0),	/* SCALING_PCLK_DIV */
+	CAM_REG(0x4F, 0x80),	/* MTX1 .. MTX6: colour matrix */
+	CAM_REG(0x50, 0x80),
+	CAM_REG(0x51, 0x00),
+	CAM_REG(0x52, 0x22),
+	CAM_REG(0x53, 0x5E),
+	CAM_REG(0x54, 0x80),
+	CAM_REG(0x13, 0xE7),	/* COM8: AGC, AWB and AEC on */
+	CAM_END
+};
+
+/* Configuration profiles (OmniVision, YUV422)
+ * - preview: QQVGA (160 x 120), one line fills CAM_LINE_MAX
+ * - capture: QVGA (320 x 240); a line is twice CAM_LINE_MAX, so capture
+ *   needs a window (ucCAM_SetWindow) that halves it
+ * - low power: QQVGA with the internal clock halved again and night mode
+ *   frame rate reduction (1/8)
+ */
+static const xCAM_Reg xCamRegsPreview[] =
+{
+	CAM_REG(0x0C, 0x04),	/* COM3: DCW enable */
+	CAM_REG(0x11, 0x01),	/* CLKRC: XCLK / 2 */
+	CAM_REG(0x3B, 0x00),	/* COM11 */
+	CAM_REG(0x3E, 0x1A),	/* COM14: manual scaling, PCLK / 4 */
+	CAM_REG(0x72, 0x22),	/* SCALING_DCWCTR: down sample by 4 */
+	CAM_REG(0x73, 0xF2),	/* SCALING_PCLK_DIV: / 4 */
+	CAM_END
+};
+
+static const xCAM_Reg xCamRegsCapture[] =
+{
+	CAM_REG(0x0C, 0x04),	/* COM3: DCW enable */
+	CAM_REG(0x11, 0x01),	/* CLKRC: XCLK / 2 */
+	CAM_REG(0x3B, 0x00),	/* COM11 */
+	CAM_REG(0x3E, 0x19),	/* COM14: manual scaling, PCLK / 2 */
+	CAM_REG(0x72, 0x11),	/* SCALING_DCWCTR: down sample by 2 */
+	CAM_REG(0x73, 0xF1),	/* SCALING_PCLK_DIV: / 2 */
+	CAM_END
+};
+
+static const xCAM_Reg xCamRegsLowPower[] =
+{
+	CAM_REG(0x0C, 0x04),	/* COM3: DCW enable */
+	CAM_REG(0x11, 0x03),	/* CLKRC: XCLK / 4 */
+	CAM_REG(0x3B, 0xE0),	/* COM11: night mode, 1/8 frame rate */
+	CAM_REG(0x3E, 0x1A),	/* COM14: manual scaling, PCLK / 4 */
+	CAM_REG(0x72, 0x22),	/* SCALING_DCWCTR: down sample by 4 */
+	CAM_REG(0x73, 0xF2),	/* SCALING_PCLK_DIV: / 4 */
+	CAM_END
+};
+
+const xCAM_Profile xCamProfilePreview =
+	{ (const signed portCHAR *) "preview", xCamRegsPreview };
+const xCAM_Profile xCamProfileCapture =
+	{ (const signed portCHAR *) "capture", xCamRegsCapture };
+const xCAM_Profile xCamProfileLowPower =
+	{ (const signed portCHAR *) "lowpower", xCamRegsLowPower };
 
 /*****************
  * vStartCAMTask *
@@ -33,43 +233,214 @@ void vStartCAMTask( unsigned portBASE_TYPE uxPriority )
  ************/
 void vCAMTask( void* pvParameters __attribute__ ((unused)))
 {
+	/* Declare local variables */
+	unsigned portCHAR *pucLine;
+	unsigned portSHORT usLine;
+	unsigned portSHORT usLen;
+	portTickType xRateStart;
+	unsigned portLONG ulRateLines;
+	unsigned portLONG ulStart;
+	unsigned portLONG ulRaw;
+	unsigned portLONG ulCode;
+	unsigned portLONG ulRateRaw = 0;
+	unsigned portLONG ulRateCode = 0;
+	unsigned portLONG ulRateCycles = 0;
+
 	/* Task initialization code (runs once) */
 
-	/* Wait for the camera to initialize after power-up/reset */
-	vTaskDelay((portTickType)1000);
+#if I2C_MEASURE == 1
+	/* Record the cost of an I2C completion (see xI2C_Cost) */
+	vI2C_MeasureCompletion();
+#endif
+
+	/* Frame-synchronous writes are queued by the VSYNC ISR, which cannot
+	 * look up a task priority: they run at this task's
+	 */
+	xCamSyncI2C.ucPriority = (unsigned portCHAR) uxTaskPriorityGet(NULL);
+
+	/* Wait for the camera to answer after power-up/reset (the table is
+	 * loaded anyway if it never does, as after a fixed delay)
+	 */
+	ucCAM_WaitReady((portTickType) CAM_READY_MAX);
+
+	/* Bring the camera up (see xCamLoad for the bring-up time) */
+	ucCAM_LoadTable(xCamInit);
+	xCamBoot.xLoaded = xTaskGetTickCount();
+
+	/* Start capturing lines, in preview mode from the first frame */
+	vCAM_StartCapture();
+	ucCAM_SetProfile(&xCamProfilePreview);
+	xRateStart = xTaskGetTickCount();
+	ulRateLines = xCamCapture.ulLines;
 
 	/* Repetitive Task code (runs forever) */
 	for(;;){
 
-#if 1
-		ucI2C_Quick(pxCamI2C, 0x00, 0xFF);
-		vTaskDelay((portTickType) 100);
+		/* Consume captured lines */
+		pucLine = pucCAM_WaitLine((portTickType) 100, &usLine, &usLen);
+		if (pucLine != NULL) {
 
-		ucI2C_Quick(pxCamI2C, 0x01, 0xEE);
-		vTaskDelay((portTickType) 100);
+			/* Boot to first frame */
+			if ((xCamBoot.xFirstFrame == 0) && (xCamCapture.ulFrames != 0)) {
+				xCamBoot.xFirstFrame = xTaskGetTickCount();
+			}
 
-		ucI2C_SendByte(pxCamI2C, 0x02, 0xDD);
-		vTaskDelay((portTickType) 100);
+			/* Exposure statistics */
+			vCAM_AELine(pucLine, usLine, usLen);
 
-		ucI2C_ReceiveByte(pxCamI2C, 0x04);
-		vTaskDelay((portTickType) 100);
+			/* Compress it (timed on T3TC: Pclk = CPU clock) */
+			ulStart = READ(T3TC);
+			usCamCodeLen = usCAM_Compress(pucLine, usLen, ucCamCode);
+			xCamCodec.ulCycles += READ(T3TC) - ulStart;
+			xCamCodec.ulLines++;
+			xCamCodec.ulRaw += usLen;
+			xCamCodec.ulCode += usCamCodeLen;
 
-		ucI2C_WriteByte (pxCamI2C, 0x08, 0xCC, 0xBB);
-		vTaskDelay((portTickType) 100);
+			vCAM_ReleaseLine(pucLine);
+		}
 
-		ucI2C_ReadByte (pxCamI2C, 0x10, 0xAA);
-		vTaskDelay((portTickType) 100);
+		/* Sustained line rate, once a second */
+		if ((xTaskGetTickCount() - xRateStart) >= configTICK_RATE_HZ) {
+			xRateStart += configTICK_RATE_HZ;
+			xCamCapture.ulLineRate = xCamCapture.ulLines - ulRateLines;
+			ulRateLines = xCamCapture.ulLines;
 
-		ucI2C_WriteWord (pxCamI2C, 0x20, 0x99, 0x88);
-		vTaskDelay((portTickType) 100);
+			/* Compression ratio and cost over the last second */
+			ulCode = xCamCodec.ulCode - ulRateCode;
+			ulRaw = xCamCodec.ulRaw - ulRateRaw;
+			if ((ulCode >= 100) && (ulRaw >= CAM_PIXEL_BYTES)) {
+				xCamCodec.usRatio = (unsigned portSHORT) (ulRaw / (ulCode / 100));
+				xCamCodec.usCycles = (unsigned portSHORT)
+					((xCamCodec.ulCycles - ulRateCycles) / (ulRaw / CAM_PIXEL_BYTES));
+			}
+			ulRateCode = xCamCodec.ulCode;
+			ulRateRaw = xCamCodec.ulRaw;
+			ulRateCycles = xCamCodec.ulCycles;
+		}
+	}
+}
 
-		ucI2C_ReadWord (pxCamI2C, 0x40, 0x77);
-		vTaskDelay((portTickType) 100);
 
-#endif
-		vTaskDelay((portTickType) 1000);
+/*********************
+ * ucCAM_LoadTable() *
+ *********************
+ * Write a camera register table (see xCAM_Reg) to the camera
+ * - each run of consecutive registers (ascending, up to camBURST_MAX) is
+ *   written as a single auto-increment burst
+ * - entries are written in table order; runs are not formed across a
+ *   delay, and the table is not sorted because register write order
+ *   matters to the sensor (e.g. the reset must come first)
+ * - returns pdTRUE if every write succeeded; xCamLoad holds the report
+ */
+unsigned portCHAR ucCAM_LoadTable( const xCAM_Reg *pxTable )
+{
+	const xCAM_Reg *pxEntry;
+	unsigned portCHAR ucStart = 0;
+	unsigned portCHAR ucLen = 0;
+	portTickType xStart = xTaskGetTickCount();
+
+	xCamLoad.usRegs = 0;
+	xCamLoad.usBursts = 0;
+	xCamLoad.usErrors = 0;
+
+	for (pxEntry = pxTable; ; pxEntry++) {
+
+		/* Extend the current run if this write continues it */
+		if ((pxEntry->ucOp == CAM_OP_WRITE) && (ucLen > 0) &&
+			(ucLen < camBURST_MAX) &&
+			(pxEntry->ucReg == (unsigned portCHAR) (ucStart + ucLen))) {
+			ucCamBurst[ucLen] = pxEntry->ucVal;
+			ucLen++;
+			continue;
+		}
+
+		/* Otherwise write out the current run first */
+		if (ucLen > 0) {
+			if (ucI2C_WriteBurst(pxCamI2C, CAM_SCCB_ADDR, ucStart,
+								 ucCamBurst, ucLen) != I2C_STOP) {
+				xCamLoad.usErrors++;
+			}
+			xCamLoad.usRegs += ucLen;
+			xCamLoad.usBursts++;
+			ucLen = 0;
+		}
+
+		if (pxEntry->ucOp == CAM_OP_END) {
+			break;
+		}
+
+		if (pxEntry->ucOp == CAM_OP_DELAY) {
+			vTaskDelay((portTickType) pxEntry->ucVal);
+		}
+		else {
+			/* Start a new run */
+			ucStart = pxEntry->ucReg;
+			ucCamBurst[0] = pxEntry->ucVal;
+			ucLen = 1;
+		}
+	}
+
+	xCamLoad.xTicks = xTaskGetTickCount() - xStart;
+
+	return (unsigned portCHAR) (xCamLoad.usErrors == 0);
+
+} /*end ucCAM_LoadTable */
+
+/*********************
+ * ucCAM_WaitReady() *
+ *********************
+ * Wait until the camera answers on SCCB, for at most xMaxWait ticks
+ * - reads the product ID register (a camera still in power-up reset does
+ *   not acknowledge), backing off between probes; the probes are
+ *   CAM_READY_FIRST, 2 x CAM_READY_FIRST, ... up to CAM_READY_BACKOFF
+ *   ticks apart (a NACKed probe itself takes well under a tick)
+ * - returns pdTRUE once the ID reads back as CAM_PID; xCamBoot has the
+ *   time taken and the number of probes
+ */
+unsigned portCHAR ucCAM_WaitReady( portTickType xMaxWait )
+{
+	portTickType xStart = xTaskGetTickCount();
+	portTickType xBackoff = (portTickType) CAM_READY_FIRST;
+
+	xCamBoot.ucReady = pdFALSE;
+	xCamBoot.usProbes = 0;
+
+	for(;;){
+
+		/* Submit the ID read directly: the blocking wrappers back off for
+		 * 35 ticks after a NACK, which would set the probe spacing instead
+		 * of xBackoff. A probe is bounded by the bus watchdog.
+		 */
+		xCamBoot.usProbes++;
+		pxCamI2C->opcode	= I2C_ReadByte;
+		pxCamI2C->addr		= CAM_SCCB_ADDR;
+		pxCamI2C->comm		= CAM_PID_REG;
+
+		if (ucI2C_Submit(pxCamI2C) == pdTRUE) {
+			if (ucI2C_Wait(pxCamI2C, (portTickType) CAM_READY_PROBE) == pdFALSE) {
+				ucI2C_Cancel(pxCamI2C);
+			}
+			if ((pxCamI2C->status == I2C_STOP) && (pxCamI2C->data[0] == CAM_PID)) {
+				xCamBoot.ucReady = pdTRUE;
+				break;
+			}
+		}
+
+		if ((xTaskGetTickCount() - xStart) >= xMaxWait) {
+			break;
+		}
+
+		vTaskDelay(xBackoff);
+		if (xBackoff < (portTickType) CAM_READY_BACKOFF) {
+			xBackoff <<= 1;
+		}
 	}
-}
+
+	xCamBoot.xReady = xTaskGetTickCount();
+
+	return xCamBoot.ucReady;
+
+} /*end ucCAM_WaitReady */
 
 
 /***************
@@ -80,6 +451,8 @@ void vCAMTask( void* pvParameters __attribute__ ((unused)))
 
 void vCAM_Init( void )
 {
+	extern void ( vCAM_ISR_Wrapper )( void );
+
 	{
 		portENTER_CRITICAL();
 
@@ -92,39 +465,702 @@ void vCAM_Init( void )
 
 		/* Configure Timer2 to generate a camera pixel clock */
 
+		/* Power up Timer2, PCONP[22] = 1 */
+		WRITE(PCONP, (READ(PCONP) | camPCONP_TIMER2));
+
 		/* Timer mode */
 		WRITE(T2CTCR, 0x00);
 
 		/* Prescale counter */
 		WRITE(T2PC, 0x0000);
+		WRITE(T2PR, 0x0000);
 
 		/* Match control
 		 * - reset on MR1
 		 */
 		WRITE(T2MCR, 0x0010);
 
-		WRITE(T2MR0, 0x0003);
-		WRITE(T2MR1, 0x0004);
+		/* MAT2.0 in PWM mode, then program and start the clock */
 		WRITE(PWM2CON, 0x00000001);
-		WRITE(T2TCR, 0x01);
+		ulCAM_SetPixelClock(CAM_XCLK_HZ, CAM_XCLK_DUTY, pdFALSE);
 
 		/* I2C queue initialization
 		 *
 		 * Set the pxCamI2C pointer to the address of the xCamI2C structure. All
 		 * I2C transaction parameters are passed via the xI2C structure. The
-		 * pxCamI2CX pointer is passed to the i2cISR via the pxI2C_RQ queue. The
+		 * pxCamI2CX pointer is passed to the I2C engine via the request queue. The
 		 * i2cISR will use the pointer to access the xI2C structure created by
 		 * the requesting task.
 		 *
-		 * Create the I2C completion queue for the CAM task and initialize the
-		 * handle to the completion queue.
+		 * Initialize the I2C completion signal for the CAM task and point the
+		 * request at it.
 		 */
 		pxCamI2C = &xCamI2C;
-		pxCamI2C->pxHandle = (void *) xQueueCreate( (unsigned portBASE_TYPE) 1, (portBASE_TYPE) NULL );
+		vI2C_SignalInit(&xCamSignal);
+		pxCamI2C->pxHandle = (void *) &xCamSignal;
 		pxCamI2C->reqID = CAM_REQID;
+
+		/* The camera is an SCCB device */
+		vI2C_SetSCCB(CAM_SCCB_ADDR, pdTRUE);
+
+		/* Frame-synchronous writes: register writes and bursts, stepped
+		 * by prvCAM_SyncDone (the priority is filled in by vCAMTask)
+		 */
+		xCamSyncI2C.reqID = CAM_REQID;
+		xCamSyncI2C.addr = CAM_SCCB_ADDR;
+		xCamSyncI2C.pxComplete = prvCAM_SyncDone;
+
+		/* Line capture
+		 *
+		 * Configure P0.10 as CAP1.0 (VSYNC) and P0.11 as CAP1.1 (HREF)
+		 * - PINSEL0[21:20] = 10, PINSEL0[23:22] = 10
+		 * - D[7:0] (P0.16 - P0.23) and PCLK (P0.12) stay GPIO inputs
+		 */
+		portENTER_CRITICAL();
+		WRITE(PINSEL0, ((READ(PINSEL0) & ~0x00F00000) | 0x00A00000));
+		portEXIT_CRITICAL();
+
+		/* Timer1 free runs at Pclk and captures on
+		 * - CAP1.0 rising edge with interrupt, T1CCR[2:0] = 101
+		 * - CAP1.1 rising edge with interrupt, T1CCR[5:3] = 101
+		 */
+		WRITE(T1TCR, 0x02);
+		WRITE(T1CTCR, 0x00);
+		WRITE(T1PR, 0x00000000);
+		WRITE(T1MCR, 0x0000);
+		WRITE(T1CCR, 0x002D);
+		WRITE(T1IR, 0xFF);
+		WRITE(T1TCR, 0x01);
+
+		/* Configure the Vectored Interrupt Controller for Timer1
+		 * - VIC channel 5 = Timer1
+		 * - Use VICVectAddr4 / VICVectCntl4
+		 * 		Set VIC IRQ "slot" enable, bit[5] = 1
+		 * 		Set VIC IRQ channel = 5 (Timer1), bits[4:0] = 00101
+		 *
+		 * 		bits[5:0] = 0x25
+		 *
+		 * The interrupt is enabled by vCAM_StartCapture().
+		 */
+		WRITE(VICVectAddr4, (unsigned portBASE_TYPE) vCAM_ISR_Wrapper);
+		WRITE(VICVectCntl4, 0x25);
+
+		/* Line-ready notification, created "given": empty it */
+		vSemaphoreCreateBinary(xCamLineSemaphore);
+		xSemaphoreTake(xCamLineSemaphore, (portTickType) 0);
 	}
 
 }
+
+
+/*************************
+ * ulCAM_SetPixelClock() *
+ *************************
+ * Set the camera pixel clock (XCLK, MAT2.0 in PWM mode) as close as
+ * possible to ulHz with a high time of ucDuty percent
+ * - returns the frequency actually generated, in Hz
+ * - xAtFrame = pdFALSE: retune now; xAtFrame = pdTRUE: retune at the next
+ *   frame boundary (vCAM_FrameBoundary), while the sensor is in vertical
+ *   blanking
+ *
+ * Timer2 counts Pclk and is reset on MR1, so the XCLK period is MR1 + 1
+ * cycles. MAT2.0 is low until TC reaches MR0 and high from MR0 to the end
+ * of the period: high time = period - MR0. The fastest clock is Pclk / 2.
+ */
+unsigned portLONG ulCAM_SetPixelClock( unsigned portLONG ulHz,
+									   unsigned portCHAR ucDuty,
+									   portBASE_TYPE xAtFrame )
+{
+	unsigned portLONG ulPeriod;
+	unsigned portLONG ulHigh;
+
+	if (ulHz == 0) {
+		ulHz = 1;
+	}
+
+	/* Closest whole number of Pclk cycles per XCLK period */
+	ulPeriod = (configCPU_CLOCK_HZ + (ulHz / 2)) / ulHz;
+	if (ulPeriod < 2) {
+		ulPeriod = 2;
+	}
+
+	/* Closest high time, at least one cycle high and one cycle low */
+	ulHigh = ((ulPeriod * ucDuty) + 50) / 100;
+	if (ulHigh < 1) {
+		ulHigh = 1;
+	}
+	if (ulHigh > (ulPeriod - 1)) {
+		ulHigh = ulPeriod - 1;
+	}
+
+	/* Hold off the frame boundary while the new values are written */
+	ucCamRetune = pdFALSE;
+	ulCamNextMR0 = ulPeriod - ulHigh;
+	ulCamNextMR1 = ulPeriod - 1;
+	ulCamXclkPeriod = ulPeriod;
+	ucCamRetune = pdTRUE;
+
+	if (xAtFrame == pdFALSE) {
+		portENTER_CRITICAL();
+		vCAM_FrameBoundary();
+		portEXIT_CRITICAL();
+	}
+
+	return configCPU_CLOCK_HZ / ulPeriod;
+
+} /*end ulCAM_SetPixelClock */
+
+/**********************
+ * ulCAM_PixelClock() *
+ **********************
+ * Current (or pending) pixel clock frequency in Hz
+ */
+unsigned portLONG ulCAM_PixelClock( void )
+{
+	return configCPU_CLOCK_HZ / ulCamXclkPeriod;
+
+} /*end ulCAM_PixelClock */
+
+/************************
+ * vCAM_FrameBoundary() *
+ ************************
+ * Apply a pending pixel clock retune (called at a frame boundary, with
+ * interrupts disabled, e.g. from the VSYNC interrupt)
+ *
+ * Timer2 has no match register shadowing, and moving MR1 below a running
+ * TC would let it run on to 0xFFFFFFFF. The timer is therefore stopped
+ * and held in reset (MAT2.0 low), reloaded, and restarted: the clock
+ * pauses for a few cycles but never produces a runt pulse.
+ */
+void vCAM_FrameBoundary( void )
+{
+	if (ucCamRetune == pdFALSE) {
+		return;
+	}
+
+	WRITE(T2TCR, 0x02);
+	WRITE(T2MR0, ulCamNextMR0);
+	WRITE(T2MR1, ulCamNextMR1);
+	WRITE(T2TCR, 0x01);
+	ucCamRetune = pdFALSE;
+
+} /*end vCAM_FrameBoundary */
+
+/***********************
+ * vCAM_StartCapture() *
+ ***********************
+ * Start capturing lines at the next frame (VSYNC)
+ */
+void vCAM_StartCapture( void )
+{
+	/* Edges from before the start are stale */
+	ucCamTimed = 0;
+
+	/* Capture is stopped, a new window can be taken now */
+	if (ucCamCropPending) {
+		xCamCrop = xCamCropNext;
+		ucCamCropPending = pdFALSE;
+	}
+	ucCamVPhase = 0;
+
+	WRITE(T1IR, 0x30);
+	WRITE(VICIntEnable, camVIC_TIMER1);
+
+} /*end vCAM_StartCapture */
+
+/**********************
+ * vCAM_StopCapture() *
+ **********************/
+void vCAM_StopCapture( void )
+{
+	WRITE(VICIntEnClear, camVIC_TIMER1);
+
+} /*end vCAM_StopCapture */
+
+/*********************
+ * ucCAM_SetWindow() *
+ *********************
+ * Set the capture window (see xCAM_Window), taking effect at the next frame
+ * - line buffers hold usWidth / ucHDec pixels (rounded up), which must fit
+ *   in CAM_LINE_MAX bytes
+ * - returns pdFALSE (and leaves the window unchanged) if it does not fit or
+ *   is empty
+ */
+unsigned portCHAR ucCAM_SetWindow( const xCAM_Window *pxWindow )
+{
+	xCAM_Crop xCrop;
+	unsigned portLONG ulOut;
+
+	if ((pxWindow->ucHDec == 0) || (pxWindow->ucVDec == 0) ||
+		(pxWindow->usWidth == 0) || (pxWindow->usHeight == 0)) {
+		return pdFALSE;
+	}
+
+	ulOut = ((((unsigned portLONG) pxWindow->usWidth + pxWindow->ucHDec - 1) /
+			  pxWindow->ucHDec) * CAM_PIXEL_BYTES);
+	if (ulOut > CAM_LINE_MAX) {
+		return pdFALSE;
+	}
+
+	xCrop.usSkip = pxWindow->usX * CAM_PIXEL_BYTES;
+	xCrop.usGap = (pxWindow->ucHDec - 1) * CAM_PIXEL_BYTES;
+	xCrop.usOut = (unsigned portSHORT) ulOut;
+	xCrop.usTop = pxWindow->usY;
+	xCrop.usBottom = ((0xFFFF - pxWindow->usY) < pxWindow->usHeight) ?
+					 0xFFFF : (pxWindow->usY + pxWindow->usHeight);
+	xCrop.ucVDec = pxWindow->ucVDec;
+
+	portENTER_CRITICAL();
+	xCamCropNext = xCrop;
+	ucCamCropPending = pdTRUE;
+	portEXIT_CRITICAL();
+
+	return pdTRUE;
+
+} /*end ucCAM_SetWindow */
+
+/*********************
+ * pucCAM_WaitLine() *
+ *********************
+ * Wait up to xTicksToWait for a captured line
+ * - returns the oldest ready line buffer (or NULL on timeout), its line
+ *   number within the frame (*pusLine) and length in bytes (*pusLen)
+ * - the buffer belongs to the caller until vCAM_ReleaseLine(); while it is
+ *   held the ISR captures into the other buffer only
+ */
+unsigned portCHAR *pucCAM_WaitLine( portTickType xTicksToWait,
+									unsigned portSHORT *pusLine,
+									unsigned portSHORT *pusLen )
+{
+	unsigned portBASE_TYPE uxBuf;
+	unsigned portBASE_TYPE uxOldest;
+
+	for(;;){
+
+		uxOldest = CAM_LINE_BUFFERS;
+
+		for (uxBuf = 0; uxBuf < CAM_LINE_BUFFERS; uxBuf++) {
+			if ((ucCamLineState[uxBuf] == camLINE_READY) &&
+				((uxOldest == CAM_LINE_BUFFERS) ||
+				 ((portLONG) (ulCamLineSeq[uxBuf] - ulCamLineSeq[uxOldest]) < 0))) {
+				uxOldest = uxBuf;
+			}
+		}
+
+		if (uxOldest < CAM_LINE_BUFFERS) {
+			ucCamLineState[uxOldest] = camLINE_HELD;
+			*pusLine = usCamLineNum[uxOldest];
+			*pusLen = usCamLineLen[uxOldest];
+			return ucCamLine[uxOldest];
+		}
+
+		/* Nothing ready: wait for the ISR (the semaphore may also be left
+		 * over from a line already taken above, hence the loop)
+		 */
+		if (xSemaphoreTake(xCamLineSemaphore, xTicksToWait) != pdTRUE) {
+			return NULL;
+		}
+	}
+
+} /*end pucCAM_WaitLine */
+
+/**********************
+ * vCAM_ReleaseLine() *
+ **********************
+ * Give a line buffer from pucCAM_WaitLine() back to the capture ISR
+ */
+void vCAM_ReleaseLine( unsigned portCHAR *pucLine )
+{
+	unsigned portBASE_TYPE uxBuf;
+
+	for (uxBuf = 0; uxBuf < CAM_LINE_BUFFERS; uxBuf++) {
+		if (pucLine == ucCamLine[uxBuf]) {
+			ucCamLineState[uxBuf] = camLINE_FREE;
+		}
+	}
+
+} /*end vCAM_ReleaseLine */
+
+/********************
+ * vCAM_GetTiming() *
+ ********************
+ * Copy the frame / line timing statistics
+ */
+void vCAM_GetTiming( xCAM_Timing *pxTiming )
+{
+	/* The ISR updates the block, take a consistent copy */
+	portENTER_CRITICAL();
+	*pxTiming = xCamTiming;
+	portEXIT_CRITICAL();
+
+} /*end vCAM_GetTiming */
+
+/**********************
+ * vCAM_ResetTiming() *
+ **********************
+ * Restart the statistics, e.g. after a camera configuration change. The
+ * next frame and line periods measured are taken as the new averages.
+ */
+void vCAM_ResetTiming( void )
+{
+	portENTER_CRITICAL();
+	xCamTiming.xFrame.ulSamples = 0;
+	xCamTiming.xLine.ulSamples = 0;
+	xCamTiming.usLines = 0;
+	xCamTiming.ulPclk = 0;
+	ucCamTimed = 0;
+	portEXIT_CRITICAL();
+
+} /*end vCAM_ResetTiming */
+
+/*********************
+ * ulCAM_FrameRate() *
+ *********************
+ * Measured frame rate in mHz (rolling average), 0 if not yet measured
+ */
+unsigned portLONG ulCAM_FrameRate( void )
+{
+	unsigned portLONG ulPeriod = xCamTiming.xFrame.ulAvg / 100;
+
+	if ((xCamTiming.xFrame.ulSamples == 0) || (ulPeriod == 0)) {
+		return 0;
+	}
+
+	/* mHz = Pclk * 1000 / period, kept within 32 bits */
+	return ((configCPU_CLOCK_HZ * 10) / ulPeriod);
+
+} /*end ulCAM_FrameRate */
+
+/*********************
+ * ucCAM_SyncWrite() *
+ *********************
+ * Hold a camera register write for the next frame boundary (see
+ * xCAM_SyncReport). Does not wait for the write.
+ * - returns pdFALSE if CAM_SYNC_MAX other registers are already held
+ */
+unsigned portCHAR ucCAM_SyncWrite( unsigned portCHAR ucReg,
+								   unsigned portCHAR ucVal )
+{
+	xCAM_Reg xReg;
+
+	xReg.ucOp = CAM_OP_WRITE;
+	xReg.ucReg = ucReg;
+	xReg.ucVal = ucVal;
+
+	return ucCAM_SyncWriteN(&xReg, 1);
+
+} /*end ucCAM_SyncWrite */
+
+/**********************
+ * ucCAM_SyncWriteN() *
+ **********************
+ * Hold ucCount register writes (CAM_OP_WRITE entries, distinct
+ * registers) for the next frame boundary, all or none: they are taken in
+ * one critical section, so a VSYNC cannot split them across two frames
+ * - returns pdFALSE, holding none of them, if there is no room for all
+ */
+unsigned portCHAR ucCAM_SyncWriteN( const xCAM_Reg *pxRegs,
+									unsigned portCHAR ucCount )
+{
+	unsigned portCHAR ucEntry;
+	unsigned portCHAR ucReg;
+	unsigned portCHAR ucNew = 0;
+	unsigned portCHAR ucResult = pdTRUE;
+
+	portENTER_CRITICAL();
+
+	/* Registers not held yet need a new entry each */
+	for (ucReg = 0; ucReg < ucCount; ucReg++) {
+		if (prvCAM_SyncFind(pxRegs[ucReg].ucReg) == ucCamSyncHeld) {
+			ucNew++;
+		}
+	}
+
+	if (ucCamSyncHeld + ucNew > CAM_SYNC_MAX) {
+		xCamSync.ulFull++;
+		ucResult = pdFALSE;
+	}
+	else {
+		for (ucReg = 0; ucReg < ucCount; ucReg++) {
+			ucEntry = prvCAM_SyncFind(pxRegs[ucReg].ucReg);
+			if (ucEntry == ucCamSyncHeld) {
+				xCamSyncHeld[ucEntry].ucOp = CAM_OP_WRITE;
+				xCamSyncHeld[ucEntry].ucReg = pxRegs[ucReg].ucReg;
+				ucCamSyncHeld++;
+			}
+			xCamSyncHeld[ucEntry].ucVal = pxRegs[ucReg].ucVal;
+		}
+	}
+
+	portEXIT_CRITICAL();
+
+	return ucResult;
+
+} /*end ucCAM_SyncWriteN */
+
+/*******************
+ * prvCAM_SyncFind *
+ *******************
+ * Held entry for ucReg, or ucCamSyncHeld if it is not held (called in a
+ * critical section)
+ */
+static unsigned portCHAR prvCAM_SyncFind( unsigned portCHAR ucReg )
+{
+	unsigned portCHAR ucEntry;
+
+	for (ucEntry = 0; ucEntry < ucCamSyncHeld; ucEntry++) {
+		if (xCamSyncHeld[ucEntry].ucReg == ucReg) {
+			break;
+		}
+	}
+
+	return ucEntry;
+
+} /*end prvCAM_SyncFind */
+
+/********************
+ * vCAM_SyncFlush() *
+ ********************
+ * Start writing the pending profile switch and the held registers (called
+ * by the capture ISR at VSYNC; ulVsyncAt is the captured VSYNC edge)
+ */
+void vCAM_SyncFlush( unsigned portLONG ulVsyncAt )
+{
+	unsigned portCHAR ucEntry;
+
+	if ((ucCamSyncHeld == 0) && (pxCamProfileNext == NULL)) {
+		return;
+	}
+
+	if (ucCamSyncBusy) {
+		xCamSync.ulDeferred++;
+		return;
+	}
+
+	for (ucEntry = 0; ucEntry < ucCamSyncHeld; ucEntry++) {
+		xCamSyncBatch[ucEntry] = xCamSyncHeld[ucEntry];
+	}
+	ucCamSyncLen = ucCamSyncHeld;
+	ucCamSyncHeld = 0;
+	ucCamSyncNext = 0;
+
+	pxCamSyncFrom = pxCamProfile;
+	pxCamSyncTo = pxCamProfileNext;
+	pxCamProfileNext = NULL;
+	usCamSyncPos = 0;
+	if (pxCamSyncTo != NULL) {
+		xCamProfile.pxFrom = pxCamSyncFrom;
+		xCamProfile.pxTo = pxCamSyncTo;
+		xCamProfile.usRegs = 0;
+		xCamProfile.usBytes = 0;
+		xCamProfile.usWrites = 0;
+	}
+
+	ulCamSyncAt = ulVsyncAt;
+	ucCamSyncBusy = pdTRUE;
+
+	if (prvCAM_SyncStep(&xCamSyncI2C)) {
+		ucI2C_SubmitFromISR(&xCamSyncI2C);
+	}
+	else {
+		/* Nothing to write (switch to an identical profile) */
+		prvCAM_SyncDone(NULL);
+	}
+
+} /*end vCAM_SyncFlush */
+
+/*******************
+ * prvCAM_SyncStep *
+ *******************
+ * Fill in the next transaction of the batch: the profile switch first
+ * (runs of consecutive changed registers as one burst), then the held
+ * writes. Returns pdFALSE when the batch is done. Runs in the ISR and in
+ * the I2C engine, so it must not block.
+ */
+static unsigned portCHAR prvCAM_SyncStep( xI2C_struct *pxI2C )
+{
+	const xCAM_Reg *pxReg;
+	unsigned portCHAR ucLen;
+
+	/* Profile switch: skip to the next register that changes */
+	while (pxCamSyncTo != NULL) {
+
+		pxReg = &pxCamSyncTo->pxRegs[usCamSyncPos];
+		if (pxReg->ucOp == CAM_OP_END) {
+			break;
+		}
+
+		if ((pxReg->ucOp != CAM_OP_WRITE) ||
+			!prvCAM_ProfileNeeds(pxCamSyncFrom, pxReg)) {
+			usCamSyncPos++;
+			continue;
+		}
+
+		/* Collect the run of changed, consecutive registers */
+		pxI2C->comm = pxReg->ucReg;
+		ucLen = 0;
+		do {
+			ucCamSyncBurst[ucLen] = pxReg->ucVal;
+			ucLen++;
+			usCamSyncPos++;
+			pxReg = &pxCamSyncTo->pxRegs[usCamSyncPos];
+		} while ((ucLen < camBURST_MAX) && (pxReg->ucOp == CAM_OP_WRITE) &&
+				 (pxReg->ucReg == (unsigned portCHAR) (pxI2C->comm + ucLen)) &&
+				 prvCAM_ProfileNeeds(pxCamSyncFrom, pxReg));
+
+		pxI2C->opcode = I2C_WriteBurst;
+		pxI2C->pucBuf = ucCamSyncBurst;
+		pxI2C->ucBufLen = ucLen;
+
+		xCamProfile.usRegs += ucLen;
+		xCamProfile.usBytes += 2 + ucLen;
+		xCamProfile.usWrites++;
+		xCamSync.ulBytes += 2 + ucLen;
+		return pdTRUE;
+	}
+
+	/* Held writes */
+	if (ucCamSyncNext < ucCamSyncLen) {
+		pxI2C->opcode = I2C_WriteByte;
+		pxI2C->comm = xCamSyncBatch[ucCamSyncNext].ucReg;
+		pxI2C->data[0] = xCamSyncBatch[ucCamSyncNext].ucVal;
+		ucCamSyncNext++;
+		xCamSync.ulBytes += 3;
+		return pdTRUE;
+	}
+
+	return pdFALSE;
+
+} /*end prvCAM_SyncStep */
+
+/*******************
+ * prvCAM_SyncDone *
+ *******************
+ * Completion handler of the frame-synchronous batch (I2C engine context):
+ * continue with the next transaction, or close the batch, make a profile
+ * switch in it active and report whether it fitted in the blanking
+ * interval. Keeps the request (returns pdTRUE): nobody waits on it.
+ *
+ * Also called with pxI2C = NULL by vCAM_SyncFlush for an empty batch.
+ */
+static portBASE_TYPE prvCAM_SyncDone( xI2C_struct *pxI2C )
+{
+	if (pxI2C != NULL) {
+
+		if (pxI2C->status != I2C_STOP) {
+			xCamSync.ulErrors++;
+		}
+		xCamSync.ulWrites++;
+
+		if (prvCAM_SyncStep(pxI2C)) {
+			ucI2C_Continue(pxI2C);
+			return pdTRUE;
+		}
+	}
+
+	/* Same timebase as the VSYNC / HREF captures */
+	xCamSync.ulLast = READ(T1TC) - ulCamSyncAt;
+	if ((xCamTiming.ulBlank != 0) && (xCamSync.ulLast <= xCamTiming.ulBlank)) {
+		xCamSync.ulFit++;
+	}
+	else {
+		xCamSync.ulOverrun++;
+	}
+	xCamSync.ulBatches++;
+
+	if (pxCamSyncTo != NULL) {
+		pxCamProfile = pxCamSyncTo;
+		pxCamSyncTo = NULL;
+		xCamProfile.ulCycles = xCamSync.ulLast;
+		xCamProfile.ucFit = ((xCamTiming.ulBlank != 0) &&
+							 (xCamSync.ulLast <= xCamTiming.ulBlank));
+		xCamProfile.ulSwitches++;
+	}
+
+	ucCamSyncBusy = pdFALSE;
+
+	return pdTRUE;
+
+} /*end prvCAM_SyncDone */
+
+/**********************
+ * ucCAM_SetProfile() *
+ **********************
+ * Switch the camera to pxProfile at the next VSYNC (see xCAM_Profile);
+ * does not wait for the switch (xCamProfile reports it when written)
+ * - a switch that has not started yet is replaced
+ * - returns the number of registers the switch will write, as far as it
+ *   is known now (see usCAM_ProfileDelta)
+ */
+unsigned portCHAR ucCAM_SetProfile( const xCAM_Profile *pxProfile )
+{
+	portENTER_CRITICAL();
+	pxCamProfileNext = pxProfile;
+	portEXIT_CRITICAL();
+
+	return (unsigned portCHAR) usCAM_ProfileDelta(pxCamProfile, pxProfile);
+
+} /*end ucCAM_SetProfile */
+
+/**********************
+ * pxCAM_GetProfile() *
+ **********************
+ * The active profile (NULL before the first switch)
+ */
+const xCAM_Profile *pxCAM_GetProfile( void )
+{
+	return pxCamProfile;
+
+} /*end pxCAM_GetProfile */
+
+/************************
+ * usCAM_ProfileDelta() *
+ ************************
+ * Number of registers a switch from pxFrom to pxTo writes (pxFrom = NULL:
+ * all of pxTo)
+ */
+unsigned portSHORT usCAM_ProfileDelta( const xCAM_Profile *pxFrom,
+									   const xCAM_Profile *pxTo )
+{
+	const xCAM_Reg *pxReg;
+	unsigned portSHORT usRegs = 0;
+
+	for (pxReg = pxTo->pxRegs; pxReg->ucOp != CAM_OP_END; pxReg++) {
+		if ((pxReg->ucOp == CAM_OP_WRITE) && prvCAM_ProfileNeeds(pxFrom, pxReg)) {
+			usRegs++;
+		}
+	}
+
+	return usRegs;
+
+} /*end usCAM_ProfileDelta */
+
+/***********************
+ * prvCAM_ProfileNeeds *
+ ***********************
+ * pdTRUE if pxReg (an entry of the target profile) must be written when
+ * switching from pxFrom: the register is not in pxFrom or has another
+ * value there
+ */
+static unsigned portCHAR prvCAM_ProfileNeeds( const xCAM_Profile *pxFrom,
+											  const xCAM_Reg *pxReg )
+{
+	const xCAM_Reg *pxOld;
+
+	if (pxFrom == NULL) {
+		return pdTRUE;
+	}
+
+	for (pxOld = pxFrom->pxRegs; pxOld->ucOp != CAM_OP_END; pxOld++) {
+		if ((pxOld->ucOp == CAM_OP_WRITE) && (pxOld->ucReg == pxReg->ucReg)) {
+			return (pxOld->ucVal != pxReg->ucVal);
+		}
+	}
+
+	return pdTRUE;
+
+} /*end prvCAM_ProfileNeeds */
+
 /*************
  * End cam.c *
  *************/
@@ -0,0 +1,376 @@
+/***********
+ * camAE.c *
+ ***********/
+
+/* FreeRTOS includes */
+#include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
+
+/* Project includes */
+#include "lpc2103.h"
+#include "cam.h"
+#include "i2c.h"
+
+/* Project defines */
+#define aeSTACK_SIZE ((unsigned portSHORT) configMINIMAL_STACK_SIZE)
+
+/* Controller
+ * - aeTARGET is the mean luminance (Y) aimed for, aeTOLERANCE the error
+ *   accepted as converged (aeSETTLE frames in a row)
+ * - the exposure-gain product is set to the value that would give
+ *   aeTARGET, changing by at most aeSTEP_MAX x per step; a frame at or
+ *   above aeSATURATED is clipped and says only "too bright", so it steps
+ *   down by aeSTEP_MAX
+ * - aeHOLD frames are skipped after a write: a frame's mean arrives
+ *   after the next frame has started, the write waits for the VSYNC
+ *   after that (see ucCAM_SyncWrite), and reacting to frames still
+ *   exposed the old way would overshoot
+ */
+#define aeTARGET		120
+#define aeTOLERANCE		8
+#define aeSETTLE		2
+#define aeSATURATED		250
+#define aeSTEP_MAX		4
+#define aeHOLD			2
+
+/* Limits
+ * - exposure in lines (row periods), at most one VGA frame
+ * - gain in 1/16ths (16 = 1x); prefer exposure, gain adds noise
+ */
+#define aeEXP_MIN		1
+#define aeEXP_MAX		500
+#define aeGAIN_MIN		16
+#define aeGAIN_MAX		128
+
+/* OmniVision registers
+ * - GAIN[7:0]: gain; the sensor multiplies by 2 for each of bits [7:4]
+ *   set and by (1 + [3:0] / 16)
+ * - exposure (16 bits) is AECHH[5:0] : AECH[7:0] : COM1[1:0]; exposure
+ *   is kept below 1024 lines so AECHH stays 0
+ * - the rest of COM1 (e.g. CCIR656, bit 6) is read once when the AE task
+ *   takes over and written back unchanged with every exposure (no
+ *   register table or profile changes COM1 after that)
+ * - COM8 = 0xE2: the table's setting (0xE7) with AGC and AEC off, the
+ *   sensor's own AWB left on
+ */
+#define aeREG_GAIN		0x00
+#define aeREG_COM1		0x04
+#define aeREG_AECH		0x10
+#define aeREG_COM8		0x13
+#define aeCOM1_AEC		0x03
+#define aeCOM8_MANUAL	0xE2
+
+#define aeREQID			0x2
+
+/* Function prototypes */
+static unsigned portCHAR prvAE_GainCode( unsigned portLONG ulGain );
+static void prvAE_Write( unsigned portLONG ulExp, unsigned portLONG ulGain );
+static unsigned portLONG prvAE_Control( unsigned portLONG ulEV,
+										unsigned portCHAR ucMean );
+
+/* Global variables */
+xI2C_struct xAEI2C;
+static xI2C_struct *pxAEI2C;
+static xI2C_Signal xAESignal;
+
+/* Frame statistics
+ * - vCAM_AELine() adds up the Y bytes of each line the CAM task receives
+ *   and posts the frame mean on xAEQueue (one frame deep: if the AE task
+ *   is behind, the frame is not used)
+ */
+static xQueueHandle xAEQueue;
+static unsigned portLONG ulAeSum;
+static unsigned portLONG ulAeCount;
+static unsigned portSHORT usAeLine;
+
+/* COM1 without the exposure bits */
+static unsigned portCHAR ucAeCom1;
+
+xCAM_AEReport xCamAE;
+
+/****************
+ * vStartAETask *
+ ****************/
+void vStartAETask( unsigned portBASE_TYPE uxPriority )
+{
+	/* The queue must exist before the CAM task posts to it */
+	xAEQueue = xQueueCreate(1, sizeof(unsigned portCHAR));
+
+	xTaskCreate( vAETask, (const signed portCHAR*)"AE", aeSTACK_SIZE,( void * ) NULL, uxPriority,( xTaskHandle * ) NULL );
+}
+
+/***********
+ * AE Task *
+ ***********
+ * Auto-exposure and gain: one control step per frame, from the mean
+ * luminance of the lines captured (so the capture window, see
+ * ucCAM_SetWindow, is also the metering window).
+ */
+void vAETask( void* pvParameters __attribute__ ((unused)))
+{
+	/* Declare local variables */
+	unsigned portCHAR ucMean;
+	unsigned portCHAR ucErr;
+	unsigned portCHAR ucSettle = 0;
+	unsigned portCHAR ucHold = 0;
+	unsigned portCHAR ucManual = pdFALSE;
+	unsigned portLONG ulEV;
+	unsigned portLONG ulExp;
+	unsigned portLONG ulGain;
+	unsigned portLONG ulStart;
+	unsigned portLONG ulFrom = 0;
+	unsigned portLONG ulLoadCycles = 0;
+	unsigned portLONG ulCycles;
+	portTickType xLoadStart;
+	portTickType xFrom;
+	portTickType xNow;
+
+	/* Task initialization code (runs once) */
+	pxAEI2C = &xAEI2C;
+	vI2C_SignalInit(&xAESignal);
+	pxAEI2C->pxHandle = (void *) &xAESignal;
+	pxAEI2C->reqID = aeREQID;
+
+	/* Start from a mid-range exposure at 1x gain */
+	ulEV = (aeEXP_MAX / 4) * aeGAIN_MIN;
+
+	xLoadStart = xTaskGetTickCount();
+	xFrom = xLoadStart;
+
+	/* Repetitive Task code (runs forever) */
+	for(;;){
+
+		if (xQueueReceive(xAEQueue, &ucMean, (portTickType) 1000) == pdTRUE) {
+
+			xCamAE.ulFrames++;
+			xCamAE.ucMean = ucMean;
+
+			/* The first frame arrives once the camera is streaming: take
+			 * exposure and gain over from the sensor
+			 */
+			if (!ucManual) {
+				/* Keep the rest of COM1, then switch AEC and AGC off (if
+				 * either access fails, try again with the next frame)
+				 */
+				if (ucI2C_ReadByte(pxAEI2C, CAM_SCCB_ADDR, aeREG_COM1) == I2C_STOP) {
+					ucAeCom1 = pxAEI2C->data[0] & ~aeCOM1_AEC;
+
+					if (ucI2C_WriteByte(pxAEI2C, CAM_SCCB_ADDR, aeREG_COM8,
+										aeCOM8_MANUAL) == I2C_STOP) {
+						ucManual = pdTRUE;
+						prvAE_Write(ulEV / aeGAIN_MIN, aeGAIN_MIN);
+						ucHold = aeHOLD;
+						xFrom = xTaskGetTickCount();
+						ulFrom = xCamAE.ulFrames;
+					}
+				}
+			}
+
+			/* Frames still showing the previous exposure */
+			else if (ucHold > 0) {
+				ucHold--;
+			}
+
+			else {
+
+				/* Convergence: from the first frame out of tolerance (with
+				 * hysteresis) to aeSETTLE frames within it
+				 */
+				ucErr = (ucMean > aeTARGET) ? (ucMean - aeTARGET) :
+											  (aeTARGET - ucMean);
+				if (ucErr <= aeTOLERANCE) {
+					if ((ucSettle < aeSETTLE) && (++ucSettle == aeSETTLE)) {
+						xCamAE.xConvTicks = xTaskGetTickCount() - xFrom;
+						xCamAE.usConvFrames = (unsigned portSHORT)
+							(xCamAE.ulFrames - ulFrom);
+						xCamAE.ulConverged++;
+					}
+				}
+				else if ((ucSettle >= aeSETTLE) && (ucErr <= 2 * aeTOLERANCE)) {
+					/* Converged, small drift: leave it */
+				}
+				else {
+					if (ucSettle >= aeSETTLE) {
+						xFrom = xTaskGetTickCount();
+						ulFrom = xCamAE.ulFrames;
+					}
+					ucSettle = 0;
+
+					/* Control step (timed on T3TC, Pclk = CPU clock) */
+					ulStart = READ(T3TC);
+					ulEV = prvAE_Control(ulEV, ucMean);
+
+					/* Exposure first, then gain for the rest */
+					ulExp = ulEV / aeGAIN_MIN;
+					if (ulExp > aeEXP_MAX) {
+						ulExp = aeEXP_MAX;
+					}
+					if (ulExp < aeEXP_MIN) {
+						ulExp = aeEXP_MIN;
+					}
+					ulGain = ulEV / ulExp;
+					if (ulGain > aeGAIN_MAX) {
+						ulGain = aeGAIN_MAX;
+					}
+					if (ulGain < aeGAIN_MIN) {
+						ulGain = aeGAIN_MIN;
+					}
+					xCamAE.ulCtrlCycles += READ(T3TC) - ulStart;
+
+					/* Write the new exposure and gain */
+					if ((ulExp != xCamAE.usExposure) || (ulGain != xCamAE.ucGain)) {
+						prvAE_Write(ulExp, ulGain);
+						ucHold = aeHOLD;
+					}
+				}
+			}
+		}
+
+		/* CPU load (statistics and control), once a second */
+		xNow = xTaskGetTickCount();
+		if ((xNow - xLoadStart) >= configTICK_RATE_HZ) {
+			ulCycles = xCamAE.ulStatCycles + xCamAE.ulCtrlCycles;
+			xCamAE.usLoad = (unsigned portSHORT) ((ulCycles - ulLoadCycles) /
+				((xNow - xLoadStart) * ((configCPU_CLOCK_HZ / configTICK_RATE_HZ) / 1000)));
+			ulLoadCycles = ulCycles;
+			xLoadStart = xNow;
+		}
+	}
+}
+
+/*****************
+ * vCAM_AELine() *
+ *****************
+ * Add one captured line to the frame statistics (called by the CAM task
+ * for every line it receives). Lines are YUV422 (Y first): the luminance
+ * is every other byte.
+ */
+void vCAM_AELine( const unsigned portCHAR *pucLine,
+				  unsigned portSHORT usLine,
+				  unsigned portSHORT usLen )
+{
+	unsigned portLONG ulStart = READ(T3TC);
+	unsigned portCHAR ucMean;
+	unsigned portSHORT usByte;
+
+	/* A line number going back means a new frame: post the last one */
+	if ((usLine <= usAeLine) && (ulAeCount != 0)) {
+		ucMean = (unsigned portCHAR) (ulAeSum / ulAeCount);
+		if (xAEQueue != NULL) {
+			xQueueSend(xAEQueue, &ucMean, (portTickType) 0);
+		}
+		ulAeSum = 0;
+		ulAeCount = 0;
+	}
+	usAeLine = usLine;
+
+	for (usByte = 0; usByte < usLen; usByte += CAM_PIXEL_BYTES) {
+		ulAeSum += pucLine[usByte];
+	}
+	ulAeCount += (usLen + CAM_PIXEL_BYTES - 1) / CAM_PIXEL_BYTES;
+
+	xCamAE.ulStatCycles += READ(T3TC) - ulStart;
+
+} /*end vCAM_AELine */
+
+/***************
+ * prvAE_Write *
+ ***************
+ * Queue exposure (lines) and gain (1/16ths) for the next frame boundary,
+ * so that no frame is exposed with half of a change
+ */
+static void prvAE_Write( unsigned portLONG ulExp, unsigned portLONG ulGain )
+{
+	xCAM_Reg xRegs[3];
+
+	xRegs[0].ucOp = CAM_OP_WRITE;
+	xRegs[0].ucReg = aeREG_AECH;
+	xRegs[0].ucVal = (unsigned portCHAR) (ulExp >> 2);
+	xRegs[1].ucOp = CAM_OP_WRITE;
+	xRegs[1].ucReg = aeREG_COM1;
+	xRegs[1].ucVal = (unsigned portCHAR) (ucAeCom1 | (ulExp & aeCOM1_AEC));
+	xRegs[2].ucOp = CAM_OP_WRITE;
+	xRegs[2].ucReg = aeREG_GAIN;
+	xRegs[2].ucVal = prvAE_GainCode(ulGain);
+
+	/* All three for the same frame, or none (retried with a later frame) */
+	if (ucCAM_SyncWriteN(xRegs, 3) != pdTRUE) {
+		xCamAE.ulErrors++;
+		return;
+	}
+
+	xCamAE.usExposure = (unsigned portSHORT) ulExp;
+	xCamAE.ucGain = (unsigned portCHAR) ulGain;
+
+} /*end prvAE_Write */
+
+/*****************
+ * prvAE_Control *
+ *****************
+ * One control step on the exposure-gain product ulEV (exposure lines x
+ * gain in 1/16ths). Luminance is about proportional to ulEV, so the value
+ * for aeTARGET is ulEV * aeTARGET / ucMean. The hold after each write keeps
+ * this from overshooting on the sensor's one frame delay.
+ */
+static unsigned portLONG prvAE_Control( unsigned portLONG ulEV,
+										unsigned portCHAR ucMean )
+{
+	unsigned portLONG ulWant;
+
+	/* No divide by zero on a black frame (the step bound applies) */
+	if (ucMean == 0) {
+		ucMean = 1;
+	}
+
+	ulWant = (ulEV * aeTARGET) / ucMean;
+	if (ucMean >= aeSATURATED) {
+		ulWant = 0;
+	}
+
+	/* Bound the step */
+	if (ulWant > ulEV * aeSTEP_MAX) {
+		ulWant = ulEV * aeSTEP_MAX;
+	}
+	if (ulWant < ulEV / aeSTEP_MAX) {
+		ulWant = ulEV / aeSTEP_MAX;
+	}
+
+	ulEV = ulWant;
+
+	/* Within what exposure and gain can reach */
+	if (ulEV < aeEXP_MIN * aeGAIN_MIN) {
+		ulEV = aeEXP_MIN * aeGAIN_MIN;
+	}
+	if (ulEV > aeEXP_MAX * aeGAIN_MAX) {
+		ulEV = aeEXP_MAX * aeGAIN_MAX;
+	}
+
+	return ulEV;
+
+} /*end prvAE_Control */
+
+/******************
+ * prvAE_GainCode *
+ ******************
+ * Gain in 1/16ths (16 .. 255) to the GAIN register: a doubling bit
+ * (GAIN[4], then [5], [6], [7]) for each factor of 2, the rest in GAIN[3:0]
+ */
+static unsigned portCHAR prvAE_GainCode( unsigned portLONG ulGain )
+{
+	unsigned portCHAR ucCode = 0;
+	unsigned portCHAR ucBit = 0x10;
+
+	while ((ulGain >= 32) && (ucBit != 0)) {
+		ucCode |= ucBit;
+		ucBit <<= 1;
+		ulGain >>= 1;
+	}
+
+	return (ucCode | ((ulGain - 16) & 0x0F));
+
+} /*end prvAE_GainCode */
+
+/***************
+ * End camAE.c *
+ ***************/
@@ -0,0 +1,143 @@
+/**************
+ * camCodec.c *
+ **************/
+
+/* FreeRTOS includes */
+#include "FreeRTOS.h"
+
+/* Project-specific includes */
+#include "FreeRTOSConfig.h"
+#include "lpc2103.h"
+#include "cam.h"
+
+/* Line code (see usCAM_Compress)
+ *
+ * Each line is coded on its own, so a lost line on the link costs only that
+ * line. Byte 0 is the header:
+ * - 0 - 7 (camRICE_K_MAX): Rice parameter k, followed by the Rice coded
+ *   prediction residuals, MSB first, padded to a byte with zeros
+ * - CAM_CODE_RAW: the line is stored as is (it did not compress)
+ *
+ * Prediction: each byte is predicted from the byte CAM_PIXEL_BYTES before
+ * it (the same byte of the previous pixel, 0 for the first pixel). The
+ * residual is taken modulo 256 and zigzag mapped (0, -1, 1, -2 ... to
+ * 0, 1, 2, 3 ...) so small residuals of either sign give small codes.
+ *
+ * Rice code of a mapped residual v: q = v >> k ones, a zero and the k low
+ * bits of v. When q reaches camRICE_ESC the code is camRICE_ESC ones and
+ * the 8 bits of v instead, so no code is longer than 24 bits.
+ */
+#define camRICE_K_MAX	7
+#define camRICE_ESC		16
+
+/********************
+ * usCAM_Compress() *
+ ********************
+ * Code one captured line (usLen bytes) into pucCode, which must hold
+ * CAM_CODE_MAX bytes. Returns the code length in bytes (header included).
+ *
+ * Placed in .fastcode, which LPC2103-rom.ld puts with .data and the startup
+ * code copies to RAM, and built in ARM mode (see the Makefile): the flash
+ * wait states and Thumb's lack of shifted operands would double the cost of
+ * this loop.
+ *
+ * The code is never longer than the line plus the header: a line whose
+ * code would not be shorter than the line is stored raw.
+ */
+unsigned portSHORT usCAM_Compress( const unsigned portCHAR *pucLine,
+								   unsigned portSHORT usLen,
+								   unsigned portCHAR *pucCode )
+								   __attribute__ ((section (".fastcode")));
+
+unsigned portSHORT usCAM_Compress( const unsigned portCHAR *pucLine,
+								   unsigned portSHORT usLen,
+								   unsigned portCHAR *pucCode )
+{
+	/* Declare local variables */
+	unsigned portLONG ulSum = 0;
+	unsigned portLONG ulAcc = 0;
+	unsigned portLONG ulFill = 0;
+	unsigned portLONG ulV;
+	unsigned portLONG ulQ;
+	unsigned portLONG ulK;
+	unsigned portSHORT usIn;
+	unsigned portSHORT usOut = 1;
+	signed portCHAR cRes;
+
+	if (usLen > CAM_LINE_MAX) {
+		usLen = CAM_LINE_MAX;
+	}
+
+	/* Pass 1: choose k so that 2^k is about the mean mapped residual */
+	for (usIn = 0; usIn < usLen; usIn++) {
+		cRes = pucLine[usIn] -
+			   ((usIn < CAM_PIXEL_BYTES) ? 0 : pucLine[usIn - CAM_PIXEL_BYTES]);
+		ulSum += (cRes < 0) ? ((((unsigned portLONG) -cRes) << 1) - 1) :
+							  (((unsigned portLONG) cRes) << 1);
+	}
+
+	ulK = 0;
+	while ((ulK < camRICE_K_MAX) && ((((unsigned portLONG) usLen) << ulK) < ulSum)) {
+		ulK++;
+	}
+	pucCode[0] = ulK;
+
+	/* Pass 2: code, giving up as soon as the line would not be smaller */
+	for (usIn = 0; usIn < usLen; usIn++) {
+
+		cRes = pucLine[usIn] -
+			   ((usIn < CAM_PIXEL_BYTES) ? 0 : pucLine[usIn - CAM_PIXEL_BYTES]);
+		ulV = (cRes < 0) ? ((((unsigned portLONG) -cRes) << 1) - 1) :
+						   (((unsigned portLONG) cRes) << 1);
+
+		ulQ = ulV >> ulK;
+		if (ulQ < camRICE_ESC) {
+			/* q ones, a zero, k bits */
+			ulAcc = (ulAcc << (ulQ + 1 + ulK)) |
+					(((1UL << (ulQ + 1)) - 2) << ulK) |
+					(ulV & ((1UL << ulK) - 1));
+			ulFill += ulQ + 1 + ulK;
+		}
+		else {
+			/* Escape: camRICE_ESC ones, 8 bits */
+			ulAcc = (ulAcc << (camRICE_ESC + 8)) |
+					(((1UL << camRICE_ESC) - 1) << 8) | ulV;
+			ulFill += camRICE_ESC + 8;
+		}
+
+		/* At most 7 + 24 bits are pending here */
+		while (ulFill >= 8) {
+			ulFill -= 8;
+			if (usOut >= usLen) {
+				break;
+			}
+			pucCode[usOut++] = (unsigned portCHAR) (ulAcc >> ulFill);
+		}
+
+		if (usOut >= usLen) {
+			break;
+		}
+	}
+
+	/* Flush the last bits */
+	if ((usIn == usLen) && (ulFill != 0) && (usOut < usLen)) {
+		pucCode[usOut++] = (unsigned portCHAR) (ulAcc << (8 - ulFill));
+		ulFill = 0;
+	}
+
+	/* Did not compress: store the line */
+	if ((usIn < usLen) || (ulFill != 0)) {
+		pucCode[0] = CAM_CODE_RAW;
+		for (usIn = 0; usIn < usLen; usIn++) {
+			pucCode[usIn + 1] = pucLine[usIn];
+		}
+		usOut = usLen + 1;
+	}
+
+	return usOut;
+
+} /* End usCAM_Compress */
+
+/******************
+ * End camCodec.c *
+ ******************/
@@ -0,0 +1,407 @@
+/************
+ * camISR.c *
+ ************/
+
+/* FreeRTOS includes */
+#include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
+#include "semphr.h"
+
+/* Project-specific includes */
+#include "FreeRTOSConfig.h"
+#include "lpc2103.h"
+#include "cam.h"
+
+/* Function prototypes */
+void vCAM_ISR_Wrapper(void) __attribute__ ((naked));
+void vCAM_ISR(void);
+static unsigned portSHORT prvCAM_ReadLine( unsigned portCHAR *pucLine,
+										   unsigned portLONG ulHref,
+										   unsigned portLONG ulEntry );
+static void prvCAM_Period( xCAM_Period *pxPeriod, unsigned portLONG ulPeriod );
+
+/* Line read (see prvCAM_ReadLine)
+ * - camREAD_LOST: returned for a line whose byte position is not known
+ * - camPCLK_EDGES: PCLK edges needed to measure the PCLK period on a line
+ * - camPCLK_GUARD: a first edge within 1/camPCLK_GUARD of a PCLK period
+ *   from a byte boundary (after the HREF edge) is ambiguous
+ */
+#define camREAD_LOST	0xFFFF
+#define camPCLK_EDGES	16
+#define camPCLK_GUARD	8
+
+/* Declare external global variables (cam.c) */
+extern xSemaphoreHandle xCamLineSemaphore;
+extern unsigned portCHAR ucCamLine[CAM_LINE_BUFFERS][CAM_LINE_MAX];
+extern volatile unsigned portCHAR ucCamLineState[CAM_LINE_BUFFERS];
+extern unsigned portSHORT usCamLineLen[CAM_LINE_BUFFERS];
+extern unsigned portSHORT usCamLineNum[CAM_LINE_BUFFERS];
+extern unsigned portLONG ulCamLineSeq[CAM_LINE_BUFFERS];
+extern unsigned portCHAR ucCamFill;
+extern unsigned portSHORT usCamLine;
+extern xCAM_Crop xCamCrop;
+extern xCAM_Crop xCamCropNext;
+extern volatile unsigned portCHAR ucCamCropPending;
+extern unsigned portCHAR ucCamVPhase;
+extern xCAM_Timing xCamTiming;
+extern unsigned portLONG ulCamVsyncAt;
+extern unsigned portLONG ulCamHrefAt;
+extern unsigned portCHAR ucCamTimed;
+
+/**********************
+ * vCAM_ISR_Wrapper() *
+ **********************/
+/* The camera ISR can cause a context switch (line-ready notification) so,
+ * like vI2C_ISR_Wrapper, this "wrapper" saves the context of the
+ * interrupted task, calls vCAM_ISR() and restores the context of the task
+ * that is to run next.
+ */
+void vCAM_ISR_Wrapper( void )
+{
+	/* Save the context of the interrupted task */
+	portSAVE_CONTEXT();
+
+	/* Call the real ISR code.
+	 *
+	 * NOTE: This must be a separate function from the wrapper to ensure
+	 * the correct stack frame is set up.
+	 */
+	vCAM_ISR();
+
+	/* Restore the context of the task that is going to run next */
+	portRESTORE_CONTEXT();
+}
+
+
+/* CAM_ISR - camera (Timer1 capture) interrupt service routine
+ * - CAP1.0 (T1IR[4]): VSYNC rising edge, start of frame
+ * - CAP1.1 (T1IR[5]): HREF rising edge, start of line
+ */
+void vCAM_ISR(void)
+{
+	/* Declare local variables */
+	portBASE_TYPE xCamWokeTask = pdFALSE;
+	unsigned portLONG ulEntry = READ(T1TC);
+	unsigned portCHAR ucIR = READ(T1IR);
+	unsigned portLONG ulIrq;
+	unsigned portSHORT usLen;
+	unsigned portCHAR ucBuf;
+	unsigned portCHAR ucKeep;
+	unsigned portLONG ulAt;
+
+	/* Start of frame */
+	if (ucIR & 0x10) {
+
+		WRITE(T1IR, 0x10);
+
+		/* Frame period from the captured VSYNC edge */
+		ulAt = READ(T1CR0);
+		if (ucCamTimed & 0x01) {
+			prvCAM_Period(&xCamTiming.xFrame, ulAt - ulCamVsyncAt);
+			xCamTiming.usLines = usCamLine;
+		}
+		ulCamVsyncAt = ulAt;
+		ucCamTimed = 0x01;
+
+		usCamLine = 0;
+		xCamCapture.ulFrames++;
+
+		/* Take a new capture window between frames */
+		if (ucCamCropPending) {
+			xCamCrop = xCamCropNext;
+			ucCamCropPending = pdFALSE;
+		}
+		ucCamVPhase = 0;
+
+		/* Retune the pixel clock now if a retune is pending */
+		vCAM_FrameBoundary();
+
+		/* Start the register writes held for this frame boundary */
+		vCAM_SyncFlush(ulAt);
+	}
+
+	/* Start of line */
+	if (ucIR & 0x20) {
+
+		WRITE(T1IR, 0x20);
+
+		/* Line period from the captured HREF edge (not across VSYNC) */
+		ulAt = READ(T1CR1);
+		if (ucCamTimed & 0x02) {
+			prvCAM_Period(&xCamTiming.xLine, ulAt - ulCamHrefAt);
+		}
+		else if (ucCamTimed & 0x01) {
+			/* First line: the vertical blanking interval */
+			xCamTiming.ulBlank = ulAt - ulCamVsyncAt;
+		}
+		ulCamHrefAt = ulAt;
+		ucCamTimed |= 0x02;
+
+		/* Lines outside the window, or dropped by vertical decimation,
+		 * are not read at all
+		 */
+		ucKeep = pdFALSE;
+		if ((usCamLine >= xCamCrop.usTop) && (usCamLine < xCamCrop.usBottom)) {
+			ucKeep = (ucCamVPhase == 0);
+			if (++ucCamVPhase >= xCamCrop.ucVDec) {
+				ucCamVPhase = 0;
+			}
+		}
+
+		if (ucKeep) {
+
+			/* Ping-pong: fill the buffer after the last one filled, or the
+			 * other one if the consumer still has it. If neither is free the
+			 * line is dropped.
+			 */
+			ucBuf = ucCamFill;
+			if (ucCamLineState[ucBuf] != camLINE_FREE) {
+				ucBuf ^= 0x01;
+			}
+
+			if (ucCamLineState[ucBuf] == camLINE_FREE) {
+
+				usLen = prvCAM_ReadLine(ucCamLine[ucBuf], ulAt, ulEntry);
+
+				/* A line read from an unknown byte position would be
+				 * shifted (and could start on a chroma byte): drop it
+				 */
+				if (usLen == camREAD_LOST) {
+					xCamCapture.ulPhaseLost++;
+				}
+				else {
+					usCamLineLen[ucBuf] = usLen;
+					usCamLineNum[ucBuf] = usCamLine;
+					ulCamLineSeq[ucBuf] = xCamCapture.ulLines;
+					ucCamLineState[ucBuf] = camLINE_READY;
+					ucCamFill = ucBuf ^ 0x01;
+
+					xCamCapture.ulLines++;
+					xCamCapture.ulBytes += usLen;
+
+					/* Notify the consumer task that a line is ready */
+					xSemaphoreGiveFromISR(xCamLineSemaphore, &xCamWokeTask);
+				}
+
+				/* Time spent in the ISR for this line (IRQs masked) */
+				ulIrq = READ(T1TC) - ulEntry;
+				xCamCapture.ulIrqLast = ulIrq;
+				if (ulIrq > xCamCapture.ulIrqMax) {
+					xCamCapture.ulIrqMax = ulIrq;
+				}
+			}
+			else {
+				xCamCapture.ulDropped++;
+			}
+		}
+
+		usCamLine++;
+	}
+
+	/* Reset Vectored Interrupt Controller priority encoder (VICVectAddr) by
+	 * doing a dummy End-of-Interrupt write to VICVectAddr (required).
+	 */
+	WRITE(VICVectAddr, 0x0);
+
+	/* Upon return form ISR yield to a higher priority task if necessary */
+	if (xCamWokeTask == pdTRUE) {
+		portYIELD_FROM_ISR();
+	}
+
+} /* End vCAM_ISR */
+
+
+/*******************
+ * prvCAM_ReadLine *
+ *******************
+ * Sample the data port (P0.16 - P0.23, FIO0PIN2) on each PCLK rising edge
+ * and store the pixels in the capture window (xCamCrop), until HREF falls
+ * or the last pixel of the window has been stored. Returns the number of
+ * bytes stored, or camREAD_LOST.
+ *
+ * Sampling starts some way into the line (interrupt latency), and the
+ * bytes clocked out before then are gone. Their number is worked out from
+ * the HREF edge captured by Timer1 (ulHref) and the PCLK period, and taken
+ * off the window's leading skip, so the window and the pixel (Y/UV) phase
+ * stay in place whatever the latency was:
+ * - the first edge sampled is a fresh one (PCLK is seen low first), and
+ *   its Timer1 time gives its byte number in the line; the sensor changes
+ *   HREF on a PCLK falling edge, so byte edges sit about half a period
+ *   after whole periods from the HREF edge
+ * - the line is lost (camREAD_LOST) if the PCLK period is not known yet,
+ *   if the first edge is too close to a byte boundary to tell which byte
+ *   it is, if the window's first byte has already gone, or if the period
+ *   measured over this line disagrees with the one used
+ * - the PCLK period (xCamTiming.ulPclk, Pclk cycles x 256) is measured on
+ *   every line of at least camPCLK_EDGES edges, lost lines included
+ *
+ * Runs in the ISR for the length of a line, so the sensor's PCLK must be
+ * slow enough for this loop (see CLKRC in the camera register table).
+ * HREF is tested in both waits so that a stalled PCLK cannot hang it, and
+ * the read is cut short once the ISR (entered at Timer1 time ulEntry) has
+ * run for CAM_IRQ_MAX cycles.
+ */
+static unsigned portSHORT prvCAM_ReadLine( unsigned portCHAR *pucLine,
+										   unsigned portLONG ulHref,
+										   unsigned portLONG ulEntry )
+{
+	unsigned portSHORT usCount = 0;
+	unsigned portSHORT usSkip = xCamCrop.usSkip;
+	unsigned portSHORT usEdges = 0;
+	unsigned portCHAR ucPixel = CAM_PIXEL_BYTES;
+	unsigned portCHAR ucKnown = pdFALSE;
+	unsigned portCHAR ucEnd = pdFALSE;
+	unsigned portCHAR ucData;
+	unsigned portLONG ulPclk = xCamTiming.ulPclk;
+	unsigned portLONG ulFirst = 0;
+	unsigned portLONG ulNow = 0;
+	unsigned portLONG ulByte;
+	unsigned portLONG ulRem;
+	unsigned portLONG ulLine;
+
+	/* Start on a fresh edge: let the current PCLK high phase pass */
+	while (READ(FIOPIN) & camPCLK_PIN) {
+		if (!(READ(FIOPIN) & camHREF_PIN)) {
+			return camREAD_LOST;
+		}
+	}
+
+	for(;;){
+
+		/* Wait for PCLK high (data valid) */
+		while (!(READ(FIOPIN) & camPCLK_PIN)) {
+			if (!(READ(FIOPIN) & camHREF_PIN)) {
+				ucEnd = pdTRUE;
+				break;
+			}
+		}
+		if (ucEnd) {
+			break;
+		}
+
+		ucData = READ(FIO0PIN2);
+		ulNow = READ(T1TC);
+
+		/* First edge: which byte of the line is this? */
+		if (usEdges == 0) {
+			ulFirst = ulNow;
+
+			if (ulPclk != 0) {
+				ulByte = ((ulFirst - ulHref) << 8) / ulPclk;
+				ulRem = ((ulFirst - ulHref) << 8) - (ulByte * ulPclk);
+
+				if ((ulRem >= ulPclk / camPCLK_GUARD) &&
+					(ulRem <= ulPclk - (ulPclk / camPCLK_GUARD)) &&
+					(ulByte <= usSkip)) {
+					usSkip -= (unsigned portSHORT) ulByte;
+					ucKnown = pdTRUE;
+				}
+			}
+		}
+		usEdges++;
+
+		if (ucKnown) {
+
+			/* Skip to the next pixel kept, then keep CAM_PIXEL_BYTES */
+			if (usSkip != 0) {
+				usSkip--;
+			}
+			else {
+				pucLine[usCount] = ucData;
+				usCount++;
+				if (--ucPixel == 0) {
+					ucPixel = CAM_PIXEL_BYTES;
+					usSkip = xCamCrop.usGap;
+				}
+			}
+
+			/* The rest of the line after the window is not waited for */
+			if (usCount >= xCamCrop.usOut) {
+				break;
+			}
+		}
+		else if (usEdges >= camPCLK_EDGES) {
+			/* Lost anyway: stop once the period has been measured */
+			break;
+		}
+
+		/* Bound the time spent with IRQs masked (Timer1 is free-running) */
+		if ((ulNow - ulEntry) > CAM_IRQ_MAX) {
+			xCamCapture.ulCut++;
+			break;
+		}
+
+		/* Wait for PCLK low */
+		while (READ(FIOPIN) & camPCLK_PIN) {
+			if (!(READ(FIOPIN) & camHREF_PIN)) {
+				ucEnd = pdTRUE;
+				break;
+			}
+		}
+		if (ucEnd) {
+			break;
+		}
+	}
+
+	/* PCLK period over this line; if it has moved, the byte number found
+	 * above may be wrong
+	 */
+	if (usEdges >= camPCLK_EDGES) {
+		ulLine = ((ulNow - ulFirst) << 8) / (usEdges - 1);
+
+		if ((ulPclk == 0) ||
+			(((ulLine > ulPclk) ? (ulLine - ulPclk) : (ulPclk - ulLine)) >
+			 (ulPclk / camPCLK_GUARD))) {
+			xCamTiming.ulPclk = ulLine;
+			ucKnown = pdFALSE;
+		}
+		else {
+			xCamTiming.ulPclk = ulPclk - (ulPclk >> 2) + (ulLine >> 2);
+		}
+	}
+
+	return (ucKnown) ? usCount : camREAD_LOST;
+
+} /* End prvCAM_ReadLine */
+
+
+/*****************
+ * prvCAM_Period *
+ *****************
+ * Add one period measurement to a rolling statistics block
+ */
+static void prvCAM_Period( xCAM_Period *pxPeriod, unsigned portLONG ulPeriod )
+{
+	unsigned portLONG ulDev;
+
+	pxPeriod->ulLast = ulPeriod;
+
+	/* First sample after a reset seeds the averages */
+	if (pxPeriod->ulSamples == 0) {
+		pxPeriod->ulAvg = ulPeriod;
+		pxPeriod->ulJitter = 0;
+		pxPeriod->ulMin = ulPeriod;
+		pxPeriod->ulMax = ulPeriod;
+	}
+
+	ulDev = (ulPeriod > pxPeriod->ulAvg) ?
+			(ulPeriod - pxPeriod->ulAvg) : (pxPeriod->ulAvg - ulPeriod);
+
+	/* avg += (x - avg) / CAM_TIMING_WEIGHT */
+	pxPeriod->ulAvg = pxPeriod->ulAvg - (pxPeriod->ulAvg >> CAM_TIMING_SHIFT) +
+					  (ulPeriod >> CAM_TIMING_SHIFT);
+	pxPeriod->ulJitter = pxPeriod->ulJitter -
+						 (pxPeriod->ulJitter >> CAM_TIMING_SHIFT) +
+						 (ulDev >> CAM_TIMING_SHIFT);
+
+	if (ulPeriod < pxPeriod->ulMin) {
+		pxPeriod->ulMin = ulPeriod;
+	}
+	if (ulPeriod > pxPeriod->ulMax) {
+		pxPeriod->ulMax = ulPeriod;
+	}
+
+	pxPeriod->ulSamples++;
+
+} /* End prvCAM_Period */
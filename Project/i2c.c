@@ -11,24 +11,253 @@
 /* Project includes */
 #include "FreeRTOSConfig.h"
 #include "lpc2103.h"
+#include "cycles.h"
 #include "i2c.h"
 
 #define i2cSTACK_SIZE	((unsigned portSHORT) configMINIMAL_STACK_SIZE)
 
+/* I2C engine state (written by vI2CTask only) */
+#define i2cENGINE_IDLE	0x00		/* No request on the bus */
+#define i2cENGINE_BUSY	0x01		/* pxI2C is being executed */
+
+/* VIC channel 9 (I2C0) bit, also used as the submission "doorbell" */
+#define i2cVIC_I2C0		0x00000200
+
+/* VIC channel 27 (Timer3) bit, the per-byte bus watchdog */
+#define i2cVIC_TIMER3	0x08000000
+
+/* VIC channel 16 (EINT2) bit, the SMBALERT# line
+ * - P0.15 = EINT2, PINSEL0[31:30] = 10
+ * - EXTINT/EXTMODE/EXTPOLAR bit 2
+ */
+#define i2cVIC_EINT2	0x00010000
+#define i2cEINT2		0x00000004
+
+/* Consecutive failed Alert Response Address reads before SMBALERT# is
+ * left masked (the line is stuck or no device claims the alert)
+ */
+#define i2cALERT_RETRIES	3
+
+/* Bus recovery pins (GPIO function while recovering)
+ * - P0.2 = SCL0, P0.3 = SDA0
+ * - half an SCL period at 100 KHz = 5 us = 295 Pclk cycles
+ */
+#define i2cSCL_PIN		0x00000004
+#define i2cSDA_PIN		0x00000008
+#define i2cHALF_BIT		295
+
+/* One byte on the bus (8 data bits + ACK) in Pclk cycles, ~90 us at
+ * 100 KHz: the shortest bus watchdog limit (see vI2C_SetTimeout)
+ */
+#define i2cBYTE_CYCLES	(9 * 2 * i2cHALF_BIT)
+
+/* Peripheral power control bits (PCONP) */
+#define i2cPCONP_I2C0	0x00000080
+#define i2cPCONP_I2C1	0x00080000
+#define i2cPCONP_TIMER3	0x00800000
+
 /* Function prototypes */
 void prvI2C_Transaction( xI2C_struct *pxI2C);
+static void prvI2C_Signal( xI2C_struct *pxI2C );
+static void prvI2C_Finish( xI2C_struct *pxI2C, unsigned portCHAR ucStatus );
+static void prvI2C_Complete( xI2C_struct *pxI2C, unsigned portCHAR ucStatus );
+static void prvI2C_ArmWatchdog( void );
+static void prvI2C_DisarmWatchdog( void );
+static void prvI2C_Recover( void );
+static void prvI2C_Delay( unsigned portLONG ulCycles );
+static void prvI2C_PowerUp( void );
+static void prvI2C_PowerDown( void );
+static void prvI2C_Event( unsigned portCHAR addr, unsigned portCHAR event, unsigned portSHORT data );
+static portBASE_TYPE prvI2C_AlertDone( xI2C_struct *pxI2C );
+static void prvI2C_Enqueue( xI2C_struct *pxI2C );
+static xI2C_struct *prvI2C_Dequeue( void );
+static unsigned portCHAR prvI2C_Reserve( portTickType xTicksToWait );
+static void prvI2C_Unreserve( xI2C_struct *pxI2C );
+static void prvI2C_Drain( void );
+static void prvI2C_Inherit( xI2C_struct *pxActive );
+static xI2C_struct *prvI2C_Select( void );
+static void prvI2C_Replenish( portTickType xNow );
+#if I2C_MEASURE == 1
+static void prvI2C_MeasureTask( void *pvParameters );
+#endif
+
+/* Atomic swap (ARM SWP), see i2cISR.c */
+extern void *pvI2C_Swap( void * volatile *ppvAddr, void *pvNew );
 
 /* Declare global variables */
-volatile unsigned portCHAR ucI2C_busy;
-xQueueHandle pxI2C_RQ;
 xSemaphoreHandle xI2CSemaphore = NULL;
 
+/* I2C request queue
+ *
+ * An intrusive multi-producer/single-consumer FIFO linked through
+ * xI2C_struct.pxNext. Requesting tasks append at pxI2C_Head with a single
+ * atomic swap; only vI2CTask removes requests (at pxI2C_Tail). xI2C_Stub is
+ * a permanent placeholder node so that the FIFO is never truly empty.
+ * - producers (tasks and ISRs) enqueue without masking interrupts or
+ *   suspending the scheduler
+ * - the consumer dequeues in prvI2C_Drain(), which vI2CTask runs with the
+ *   scheduler suspended (to drain and re-evaluate its inherited priority
+ *   in one step, see prvI2C_Inherit); interrupts stay enabled, so an ISR
+ *   can still enqueue while the queue is being drained
+ */
+static xI2C_struct xI2C_Stub;
+static xI2C_struct * volatile pxI2C_Head;
+static xI2C_struct *pxI2C_Tail;
+
+/* Request queue admission (see prvI2C_Reserve)
+ * - a request holds one of I2C_QUEUE_DEPTH slots from submission until the
+ *   engine starts it (or returns it without starting it)
+ * - xI2C_SlotSignal holds the tasks blocked waiting for a free slot
+ * - xI2C_Queue is the sizing report (depth, peak depth, full events)
+ */
+static xI2C_Signal xI2C_SlotSignal;
+xI2C_QueueStats xI2C_Queue;
+
+/* Ready list (engine only)
+ *
+ * Before each dispatch the engine moves everything from the request queue
+ * onto this private list (arrival order, linked through pxNext) and picks
+ * the next request from it earliest-deadline-first (see prvI2C_Select).
+ * - ulI2C_DeadlineMisses counts requests failed with I2C_EXPIRED before
+ *   they were started
+ * - ulI2C_DeadlineLate counts requests that were started in time but
+ *   completed after their deadline
+ */
+static xI2C_struct *pxI2C_Ready;
+static xI2C_struct *pxI2C_ReadyTail;
+
+/* Requests continued by completion handlers (engine only, see
+ * ucI2C_Continue), spliced onto the front of the ready list by
+ * prvI2C_Drain
+ */
+static xI2C_struct *pxI2C_Continued;
+static xI2C_struct *pxI2C_ContinuedTail;
+unsigned portLONG ulI2C_DeadlineMisses;
+unsigned portLONG ulI2C_DeadlineLate;
+
+/* Bus bandwidth budgets (engine enforced, see prvI2C_Select)
+ * - bus time is measured on Timer3 (free running at Pclk) from the START
+ *   of a request (ulI2C_BusStart) to its completion and charged to the
+ *   request's reqID
+ * - lTokens is the bus time left in the current period, in Pclk cycles;
+ *   ulReserved == 0 marks an unused entry
+ * - xI2C_Block is how long the engine may block: until the next period if
+ *   a request is being held back, otherwise until the next interrupt
+ */
+static struct
+{
+	unsigned portCHAR reqID;
+	unsigned portLONG ulReserved;
+	portLONG lTokens;
+	unsigned portLONG ulUsed;
+	unsigned portLONG ulLastUsed;
+	unsigned portLONG ulDeferred;
+} xI2C_Budgets[I2C_BUDGETS];
+
+static portTickType xI2C_Period;
+static portTickType xI2C_Block = portMAX_DELAY;
+static unsigned portLONG ulI2C_BusStart;
+
+/* I2C engine state (i2cENGINE_IDLE or i2cENGINE_BUSY)
+ *
+ * Owned by vI2CTask: only the engine starts a request, so there is no
+ * busy flag for requesting tasks to test-and-set.
+ */
+static volatile unsigned portCHAR ucI2C_state;
+
+/* Bus watchdog (Timer3 match 0, see vI2C_TimerISR in i2cISR.c)
+ * - ulI2C_Timeout is the limit for any single I2C0 state transition, in
+ *   Pclk cycles (Timer3 counts Pclk)
+ * - ucI2C_Expired is set by the Timer3 ISR when the limit is exceeded
+ * - ulI2C_Timeouts counts the transactions aborted by the watchdog
+ */
+static unsigned portLONG ulI2C_Timeout;
+volatile unsigned portCHAR ucI2C_Expired;
+unsigned portLONG ulI2C_Timeouts;
+
+/* I2C0 power gating
+ * - I2C0 is powered down (PCONP) whenever the engine is idle and the
+ *   request queue is empty, and powered up again by the next dispatch
+ * - ulI2C_PowerUps counts the re-enables, ulI2C_PowerUpCycles is the Pclk
+ *   cost of the most recent one (added to that request's latency)
+ */
+static unsigned portCHAR ucI2C_Powered;
+unsigned portLONG ulI2C_PowerUps;
+unsigned portLONG ulI2C_PowerUpCycles;
+
+/* SMBus event handling (SMBALERT# and Host Notify)
+ * - xI2C_Handlers maps a device address to its event handler
+ * - xI2C_Alert is the driver's own Alert Response Address read request
+ * - ucI2C_AlertPending is set by the EINT2 ISR (see i2cISR.c)
+ * - ucI2C_Notify enables the Host Notify slave (address I2C_HOST_ADDR),
+ *   ucI2C_Slave is set while another master is addressing it and
+ *   ucI2C_NotifyData collects the Host Notify message
+ * - the bus watchdog also runs while we are addressed as a slave;
+ *   ulI2C_SlaveTimeouts counts the Host Notify messages abandoned part
+ *   way (the sender reset or gave up), after which slave mode is left
+ */
+static struct
+{
+	unsigned portCHAR addr;
+	pxI2C_EventHandler pxHandler;
+} xI2C_Handlers[I2C_EVENT_HANDLERS];
+
+static xI2C_struct xI2C_Alert;
+static unsigned portCHAR ucI2C_AlertFailures;
+volatile unsigned portCHAR ucI2C_AlertPending;
+static unsigned portCHAR ucI2C_Notify;
+static unsigned portCHAR ucI2C_Slave;
+static unsigned portCHAR ucI2C_NotifyData[3];
+static unsigned portCHAR ucI2C_NotifyCount;
+unsigned portLONG ulI2C_Alerts;
+unsigned portLONG ulI2C_Notifies;
+unsigned portLONG ulI2C_SlaveTimeouts;
+
+/* SCCB devices (see vI2C_SetSCCB)
+ * - one bit per 7-bit slave address, same layout as a bus scan map
+ */
+static unsigned portCHAR ucI2C_SCCBMap[I2C_SCAN_MAP_SIZE];
+
+/* Engine priority inheritance (see prvI2C_Inherit)
+ * - xI2CTask is the engine task, uxI2C_BasePriority the priority it was
+ *   started with and runs at when no requester is waiting on it
+ * - ulI2C_PickupLast/Max is the time from a request being queued to the
+ *   engine taking it off the request queue, in Pclk cycles; it includes
+ *   any time the engine was kept from running by other tasks (priority
+ *   inversion), with or without I2C_INHERIT
+ * - ulI2C_Boosts counts the submissions that raised the engine priority
+ */
+static xTaskHandle xI2CTask;
+static unsigned portBASE_TYPE uxI2C_BasePriority;
+unsigned portLONG ulI2C_PickupLast;
+unsigned portLONG ulI2C_PickupMax;
+unsigned portLONG ulI2C_Boosts;
+
+/* Request descriptor pool and free list */
+static xI2C_struct xI2C_Pool[I2C_POOL_SIZE];
+static xI2C_struct *pxI2C_Free;
+
+/* Completion cost report (see vI2C_MeasureCompletion) */
+xI2C_CompletionCost xI2C_Cost;
+
+#if I2C_MEASURE == 1
+/* Blocked-path measurement (vI2C_MeasureCompletion and
+ * prvI2C_MeasureTask only)
+ * - the helper task blocks on xI2C_MeasureQueue, then on pxI2C_Measure,
+ *   and stamps ulI2C_Woken each time it runs again
+ */
+static xQueueHandle xI2C_MeasureQueue;
+static xI2C_struct *pxI2C_Measure;
+static volatile unsigned portLONG ulI2C_Woken;
+#endif
+
 /*****************
  * vStartI2CTask *
  *****************/
 void vStartI2CTask( unsigned portBASE_TYPE uxPriority )
 {
-	xTaskCreate( vI2CTask, (const signed portCHAR*)"I2C", i2cSTACK_SIZE,( void * ) NULL, uxPriority,( xTaskHandle * ) NULL );
+	uxI2C_BasePriority = uxPriority;
+	xTaskCreate( vI2CTask, (const signed portCHAR*)"I2C", i2cSTACK_SIZE,( void * ) NULL, uxPriority,( xTaskHandle * ) &xI2CTask );
 }
 
 /************
@@ -53,9 +282,15 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
 	static unsigned portCHAR ucI2C_cstate;	/* Current I2C transaction state */
 	static unsigned portCHAR ucI2C_wr_count;/* # of data bytes transmitted */
 	static unsigned portCHAR ucI2C_rd_count;/* # of data bytes received */
-
-	/* Pending transaction flag */
-	static unsigned portCHAR ucI2C_pending = pdFALSE;
+	static unsigned portCHAR ucI2C_probe;	/* Current bus scan address */
+	static unsigned portCHAR ucI2C_abort;	/* Cancelled read is being
+											   NACKed to a STOP */
+	static const xI2C_Prepared *pxI2C_Op;	/* Access performed by the
+											   current request (opcode,
+											   addr, comm) */
+	static xI2C_Prepared xI2C_Op;			/* Copy of a request's own
+											   opcode, addr and comm */
+	static unsigned portCHAR ucI2C_sccb;	/* Current device speaks SCCB */
 
 	/* Task initialization code goes here (runs once)
 	 * - none currently
@@ -66,9 +301,23 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
 
 		/* Check the I2C semaphore for a deferred I2C interrupt
 		 * - proceed only if a the semaphore has been "given"
-		 * - if semaphore has not been given, delay 1 "tick" and try again
+		 * - block until the semaphore is given so that every I2C0 state
+		 *   transition is serviced as soon as i2cISR.c defers it (a
+		 *   polling delay here would add a full tick to every byte)
+		 * - while a request is held back by its bandwidth budget, block no
+		 *   longer than the start of the next budget period
 		 */
-		if (xSemaphoreTake(xI2CSemaphore, (portTickType) 1) == pdTRUE) {
+		if (xSemaphoreTake(xI2CSemaphore, xI2C_Block) == pdTRUE) {
+
+			/* Acknowledge the submission doorbell (if rung).
+			 *
+			 * A requesting task rings the doorbell after queuing a request
+			 * by forcing VIC channel 9 with VICSoftInt (see prvI2C_Enqueue).
+			 * It is cleared BEFORE the request queue is examined below, so
+			 * a request queued after this point rings it again and this
+			 * task runs another pass; a queued request is never stranded.
+			 */
+			WRITE(VICSoftIntClear, i2cVIC_I2C0);
 
 			/* i2cISR.c determined that an I2C interrupt was asserted at the
 			 * VIC. Verify that I2C0 controller is reporting an interrupt.
@@ -82,6 +331,13 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
 				/* I2C0 interrupt is asserted, get current I2C status */
 				ucI2C_status = READ(I2C0STAT);
 
+				/* SCCB devices leave the ninth bit of a write undefined
+				 * ("don't care"), so a data NACK is as good as an ACK.
+				 */
+				if ((ucI2C_sccb == pdTRUE) && (ucI2C_status == 0x30)) {
+					ucI2C_status = 0x28;
+				}
+
 				/* Save "last" state.
 				 *
 				 * NOTE: if this is the start of a new I2C transaction then
@@ -144,38 +400,33 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
 					/* Clear the start bit */
 					WRITE(I2C0CONCLR, 0x20);
 
-					/* An I2C transaction can be started in one of two ways...
-					 *
-					 * 1) ucI2C_pending == pdFALSE
-					 *
-					 *    The request queue was empty and a new I2C transaction
-					 *    request is queued and initiated by prvI2C_Transaction().
-					 *
-					 *    In this case, the I2C request is removed from the I2C
-					 *    request queue by code following this comment.
-					 *
-					 * 2) ucI2C_pending == pdTRUE
-					 *
-					 *    A previous I2C transaction was completed by this I2C
-					 *    interrupt handling code and at least one I2C
-					 *    request was pending (queued) at that time.
-					 *
-					 *    The next request was removed from the queue and the
-					 *    I2C transaction was initiated by code at the bottom
-					 *    of this interrupt handling code.
+					/* A bus scan issues a STOP followed by a START for every
+					 * probe address (see I2C_SCAN_NEXT below). Transmit the
+					 * next probe address with the write bit (quick write).
 					 */
-					if (ucI2C_pending == pdFALSE) {
+					if (ucI2C_cstate == I2C_SCAN_NEXT) {
+						ucI2C_cstate = I2C_QUICK;
+						WRITE(I2C0DAT, ucI2C_probe << 1);
+						break;
+					}
 
-						/* prvI2C_Transaction() started the I2C transaction
-						 *
-						 * Get the request from the I2C transaction request
-						 * queue. The "request" is the address of a pointer
-						 * to a structure that contains the I2C transaction
-						 * parameters.
-						 */
-						xQueueReceive(pxI2C_RQ, &(pxI2C), (portTickType) 0);
+					/* SCCB has no REPEATED-START: the read phase of a READ
+					 * BYTE or READ WORD follows a STOP and a new START (see
+					 * case 0x28). Transmit the read address as case 0x10
+					 * would.
+					 */
+					if (ucI2C_cstate == I2C_RSTART) {
+						ucI2C_cstate = I2C_RD_ADDR;
+						ucI2C_saddr = ucI2C_saddr | 0x01;
+						WRITE(I2C0DAT, ucI2C_saddr);
+						break;
+					}
 
-					} /* end if (ucI2C_pending == pdFALSE) */
+					/* Every I2C transaction is started by the dispatch code
+					 * at the bottom of this handler, which has already
+					 * removed the request from the I2C request queue and
+					 * pointed pxI2C at it.
+					 */
 
 					/* Compose the I2C address.
 					 *
@@ -184,7 +435,7 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
 					 * 					0 = write
 					 * 					1 = read
 					 */
-					ucI2C_saddr = pxI2C->addr << 1;
+					ucI2C_saddr = pxI2C_Op->addr << 1;
 
 					/* ucI2C_saddr[0] = 0 as a result of the left shift
 					 * which indicates an I2C write transaction by DEFAULT.
@@ -203,16 +454,24 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
 					 */
 					ucI2C_cstate = I2C_WR_ADDR;
 
-					if (pxI2C->opcode == I2C_ReceiveByte){
+					if (pxI2C_Op->opcode == I2C_ReceiveByte){
 						ucI2C_saddr = ucI2C_saddr | 0x01;
 						ucI2C_cstate = I2C_RD_ADDR;
 					}
 
-					if (pxI2C->opcode == I2C_Quick){
+					if (pxI2C_Op->opcode == I2C_Quick){
 						ucI2C_saddr = ucI2C_saddr | (0x01 & pxI2C->data[0]);
 						ucI2C_cstate = I2C_QUICK;
 					}
 
+					/* A bus scan starts with a quick write to the first
+					 * address of the range (pxI2C_Op->addr).
+					 */
+					if (pxI2C_Op->opcode == I2C_Scan){
+						ucI2C_probe = pxI2C_Op->addr;
+						ucI2C_cstate = I2C_QUICK;
+					}
+
 					/* Load the slave address for transmission */
 					WRITE(I2C0DAT, ucI2C_saddr);
 
@@ -245,7 +504,7 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
 						 *
 						 * Reset the current state.
 						 */
-						if (pxI2C->opcode == I2C_ReceiveByte){
+						if (pxI2C_Op->opcode == I2C_ReceiveByte){
 
 							ucI2C_cstate = I2C_RD_ADDR;
 						}
@@ -287,7 +546,7 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
 				 */
 				case 0x18:
 
-					switch( pxI2C->opcode){
+					switch( pxI2C_Op->opcode){
 
 					case 0:	/* QUICK COMMAND */
 						/* Transaction complete
@@ -305,6 +564,16 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
 
 						break; /* case 0 QUICK COMMAND */
 
+					case I2C_Scan:
+						/* The probed address is present. Mark it in the
+						 * presence map and move on to the next address.
+						 */
+						pxI2C->pucBuf[ucI2C_probe >> 3] |=
+							(unsigned portCHAR) (0x01 << (ucI2C_probe & 0x07));
+						ucI2C_cstate = I2C_SCAN_NEXT;
+
+						break; /* case I2C_Scan */
+
 					case 1: /* SEND BYTE */
 						/* Set current I2C transaction state */
 						ucI2C_cstate = I2C_WR_DATA;
@@ -319,6 +588,7 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
 					case 4: /* READ BYTE */
 					case 5: /* WRITE WORD */
 					case 6: /* READ WORD */
+					case I2C_WriteBurst:
 
 						/* All of these transactions include a I2C
 						 * command byte.
@@ -328,7 +598,7 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
 						ucI2C_cstate = I2C_COMMAND;
 
 						/* Transmit command byte */
-						WRITE(I2C0DAT, pxI2C->comm);
+						WRITE(I2C0DAT, pxI2C_Op->comm);
 
 						break; /* case 3 - 9 */
 
@@ -345,7 +615,7 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
 						 * interrupt handler
 						 */
 
-					} /* End switch( pxI2C->opcode) */
+					} /* End switch( pxI2C_Op->opcode) */
 
 					break; /* case 0x18 */
 
@@ -358,6 +628,18 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
 				 * This can only occur in Master-Transmit mode.
 				 */
 				case 0x20:
+					/* During a bus scan a NACK simply means that no device
+					 * answers at the probed address. Clear it in the
+					 * presence map and move on to the next address.
+					 */
+					if (pxI2C_Op->opcode == I2C_Scan) {
+						pxI2C->pucBuf[ucI2C_probe >> 3] &=
+							(unsigned portCHAR) ~(0x01 << (ucI2C_probe & 0x07));
+						ucI2C_cstate = I2C_SCAN_NEXT;
+
+						break;
+					}
+
 					/* Slave NACK'd the transaction
 					 *
 					 * - this is an ERROR condition
@@ -383,7 +665,7 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
 				 */
 				case 0x28:
 
-					switch( pxI2C->opcode){
+					switch( pxI2C_Op->opcode){
 
 					case 1: /* SEND BYTE */
 						/* Set current I2C transaction state */
@@ -400,8 +682,18 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
 
 					case 3: /* WRITE BYTE */
 					case 5: /* WRITE WORD */
-						if( ((pxI2C->opcode == I2C_WriteByte) && (ucI2C_wr_count < 1)) ||
-						    ((pxI2C->opcode == I2C_WriteWord) && (ucI2C_wr_count < 2)) ){
+					case I2C_WriteBurst:
+						if( (pxI2C_Op->opcode == I2C_WriteBurst) &&
+							(ucI2C_wr_count < pxI2C->ucBufLen) ){
+							/* Set current I2C transaction state */
+							ucI2C_cstate = I2C_WR_DATA;
+
+							/* Transmit the next burst byte */
+							WRITE(I2C0DAT, pxI2C->pucBuf[ucI2C_wr_count]);
+							ucI2C_wr_count++;
+						}
+						else if( ((pxI2C_Op->opcode == I2C_WriteByte) && (ucI2C_wr_count < 1)) ||
+						    ((pxI2C_Op->opcode == I2C_WriteWord) && (ucI2C_wr_count < 2)) ){
 							/* Set current I2C transaction state */
 							ucI2C_cstate = I2C_WR_DATA;
 
@@ -424,14 +716,23 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
 						}
 						break;	/* Case 3 WRITE BYTE */
 								/* Case 5 WRITE WORD */
+								/* Case I2C_WriteBurst */
 
 					case 4: /* READ BYTE */
 					case 6: /* READ WORD */
 						/* Set current I2C transaction state */
 						ucI2C_cstate = I2C_RSTART;
 
-						/* Transmit a REPEATED-START */
-						WRITE(I2C0CONSET, 0x20);
+						/* Transmit a REPEATED-START
+						 * - SCCB: transmit a STOP followed by a START
+						 *   instead (STO and STA together)
+						 */
+						if (ucI2C_sccb == pdTRUE) {
+							WRITE(I2C0CONSET, 0x30);
+						}
+						else {
+							WRITE(I2C0CONSET, 0x20);
+						}
 
 						break; /* case 4 READ BYTE
 								* case 6 READ WORD
@@ -449,7 +750,7 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
 						 * interrupt handler).
 						 */
 
-					} /* End switch( pxI2C->opcode) */
+					} /* End switch( pxI2C_Op->opcode) */
 
 					break; /* case 0x28 */
 
@@ -505,7 +806,7 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
 				 */
 				case 0x40:
 
-					switch(pxI2C->opcode){
+					switch(pxI2C_Op->opcode){
 
 					case 0:	/* QUICK COMMAND */
 						/* Transaction complete
@@ -534,8 +835,8 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
 						 */
 						ucI2C_cstate = I2C_RD_ADDR_ACK;
 
-						if( (pxI2C->opcode == I2C_ReceiveByte) ||
-							(pxI2C->opcode == I2C_ReadByte) ) {
+						if( (pxI2C_Op->opcode == I2C_ReceiveByte) ||
+							(pxI2C_Op->opcode == I2C_ReadByte) ) {
 
 							/* RECEIVE BYTE or READ BYTE
 							 *
@@ -571,7 +872,7 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
 						 * interrupt handler).
 						 */
 
-					} /* End switch(pxI2C->opcode) */
+					} /* End switch(pxI2C_Op->opcode) */
 
 					break; /* case 0x40 */
 
@@ -604,7 +905,7 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
 				 * Occurs in Master-Receive mode only.
 				 */
 				case 0x50:
-					switch(pxI2C->opcode){
+					switch(pxI2C_Op->opcode){
 
 						case 6: /* READ WORD */
 							/* The first byte of read data has been received
@@ -639,7 +940,7 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
 							 * interrupt handler).
 							 */
 
-					} /* switch(pxI2C->opcode) */
+					} /* switch(pxI2C_Op->opcode) */
 
 					break; /* case 0x50 */
 
@@ -672,6 +973,97 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
 					break;
 
 
+				/*****************************************************
+				 * CASE 0x60 - Own SLA+W received, ACK transmitted   *
+				 * CASE 0x68 - Arbitration lost, own SLA+W received *
+				 *****************************************************
+				 * Slave-Receive mode only. Another master (an SMBus device
+				 * sending Host Notify) has addressed the LPC2103 at
+				 * I2C_HOST_ADDR.
+				 */
+				case 0x60:
+				case 0x68:
+					ucI2C_cstate = I2C_SLAVE;
+					ucI2C_Slave = pdTRUE;
+					ucI2C_NotifyCount = 0;
+
+					/* Time the message like a transaction, so that a sender
+					 * that stops part way cannot hold us in slave mode
+					 */
+					prvI2C_ArmWatchdog();
+
+					/* Acknowledge the data bytes that follow.
+					 *
+					 * If our own master transaction lost arbitration (0x68)
+					 * also request a START so that it is replayed from the
+					 * beginning (case 0x08) once the bus is free again.
+					 */
+					if (ucI2C_status == 0x68) {
+						WRITE(I2C0CONSET, 0x24);
+					}
+					else {
+						WRITE(I2C0CONSET, 0x04);
+					}
+
+					break; /* case 0x60, 0x68 */
+
+
+				/**********************************************************
+				 * CASE 0x80 - Addressed, data byte received, ACK returned *
+				 * CASE 0x88 - Addressed, data byte received, NACK returned *
+				 **********************************************************
+				 * Host Notify message:
+				 *   byte 0 = device address (bits[7:1])
+				 *   byte 1 = data low byte
+				 *   byte 2 = data high byte
+				 */
+				case 0x80:
+				case 0x88:
+					ucI2C_cstate = I2C_SLAVE;
+					prvI2C_ArmWatchdog();
+
+					if (ucI2C_NotifyCount < sizeof(ucI2C_NotifyData)) {
+						ucI2C_NotifyData[ucI2C_NotifyCount] = READ(I2C0DAT);
+						ucI2C_NotifyCount++;
+					}
+
+					/* ACK up to the last byte of the message, and always
+					 * re-enable recognition of our own slave address.
+					 */
+					if ((ucI2C_status == 0x80) &&
+						(ucI2C_NotifyCount >= sizeof(ucI2C_NotifyData))) {
+						WRITE(I2C0CONCLR, 0x04);
+					}
+					else {
+						WRITE(I2C0CONSET, 0x04);
+					}
+
+					break; /* case 0x80, 0x88 */
+
+
+				/*************************************************
+				 * CASE 0xA0 - STOP or REPEATED START received   *
+				 *             while addressed as a slave        *
+				 *************************************************/
+				case 0xA0:
+					ucI2C_cstate = I2C_SLAVE;
+					ucI2C_Slave = pdFALSE;
+
+					/* Deliver a complete Host Notify message */
+					if (ucI2C_NotifyCount == sizeof(ucI2C_NotifyData)) {
+						ulI2C_Notifies++;
+						prvI2C_Event((unsigned portCHAR) (ucI2C_NotifyData[0] >> 1),
+									 I2C_EVENT_NOTIFY,
+									 (unsigned portSHORT) (ucI2C_NotifyData[1] |
+									 (ucI2C_NotifyData[2] << 8)));
+					}
+
+					/* Re-enable recognition of our own slave address */
+					WRITE(I2C0CONSET, 0x04);
+
+					break; /* case 0xA0 */
+
+
 				/************************
 				 * CASE DEFAULT - ERROR *
 				 ************************
@@ -689,11 +1081,59 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
 				} /* End switch(ucI2C_status) */
 
 
+				/* Advance a bus scan to the next probe address.
+				 *
+				 * Setting STOP and START together terminates the current
+				 * probe and immediately begins the next one (case 0x08)
+				 * without completing the request. The whole sweep runs
+				 * back-to-back inside this handler; the requesting task is
+				 * only signalled once the last address has been probed.
+				 */
+				if (ucI2C_cstate == I2C_SCAN_NEXT) {
+
+					if (ucI2C_probe < pxI2C_Op->comm) {
+						ucI2C_probe++;
+						WRITE(I2C0CONSET, 0x30);
+					}
+					else {
+						/* Last address probed, complete the request */
+						ucI2C_cstate = I2C_STOP;
+					}
+				} /* end if (ucI2C_cstate == I2C_SCAN_NEXT) */
+
+
+				/* Abort a cancelled request at this byte boundary (unless
+				 * it has just finished anyway).
+				 *
+				 * - Master Receive with ACK (0x40, 0x50): the slave is about
+				 *   to drive the next byte, so it is NACKed instead (clear
+				 *   AA) and the STOP is sent once it is in (0x58)
+				 * - otherwise: drop any repeated START and send a STOP now
+				 */
+				if ((ucI2C_state == i2cENGINE_BUSY) &&
+					(ucI2C_Slave == pdFALSE) &&
+					(pxI2C->cancel == pdTRUE) &&
+					((ucI2C_abort == pdTRUE) ||
+					 ((ucI2C_cstate != I2C_STOP) &&
+					  (ucI2C_cstate != I2C_ERROR_STOP)))) {
+
+					if ((ucI2C_status == 0x40) || (ucI2C_status == 0x50)) {
+						WRITE(I2C0CONCLR, 0x04);
+						ucI2C_abort = pdTRUE;
+					}
+					else {
+						WRITE(I2C0CONCLR, 0x20);
+						ucI2C_cstate = I2C_CANCELLED;
+					}
+				} /* end if (... (pxI2C->cancel == pdTRUE) ...) */
+
+
 				/* If the transaction is done or an error occurred then generate
 				 * an I2C transaction "completion" to the requesting task.
 				 */
 				if( (ucI2C_cstate == I2C_STOP) ||
-					(ucI2C_cstate == I2C_ERROR_STOP) ) {
+					(ucI2C_cstate == I2C_ERROR_STOP) ||
+					(ucI2C_cstate == I2C_CANCELLED) ) {
 
 					/* If I2C_STOP:
 					 *
@@ -706,64 +1146,34 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
 					 *   I2C transaction and restores the I2C controller to an
 					 *   operational state. This terminates, but does not recover
 					 *   an I2C transaction that may have been in progress.
+					 *
+					 * If I2C_CANCELLED:
+					 *
+					 * - The STOP frees the bus for the next request.
 					 */
 					WRITE(I2C0CONSET, 0x10);
 
 					/* Return status, read length (count), and read data
 					 * - pxI2C->rd_len and pxI2C->data[] already contain data
 					 * - need to update pxI2C->status here
-					 */
-					pxI2C->status = ucI2C_cstate;
-
-
-					/* Return the completion for the I2C transaction request */
-					xQueueSendToBack(pxI2C->pxHandle, (void *) NULL, (portTickType) 0);
-
-
-					/* Done with the prior I2C transaction. Check for a new
-					 * (pending) transaction.
-					 *
-					 * An I2C transaction can be started in one of two ways:
 					 *
-					 * - The request queue was empty and a new I2C transaction
-					 *   request is queued and started by prvI2C_Transaction().
-					 *   In this case the new request is removed from the queue
-					 *   at the top of this I2C interrupt handler.
-					 *
-					 *   - see "switch(ucI2C_status)" case 0x08
-					 *
-					 * - An I2C transaction was completed by this interrupt
-					 *   handler and at least one I2C transactions was pending
-					 *   (already queued). In this case the next I2C
-					 *   transaction is started and the request is removed
-					 *   from the queue by the code below...
+					 * NOTE: a bus error seen while no request is active
+					 *       (e.g. in slave mode) only needs the STOP above.
 					 */
-					ucI2C_pending = (unsigned portCHAR) xQueueReceive(pxI2C_RQ,
-							         &(pxI2C), (portTickType) 0);
+					if (ucI2C_state == i2cENGINE_BUSY) {
+						prvI2C_Finish(pxI2C, ucI2C_cstate);
+					}
 
-					if (ucI2C_pending == pdTRUE) {
+					ucI2C_Slave = pdFALSE;
 
-						/* A transaction is pending
-						 * - the I2C request queue was NOT empty
-						 *
-						 * Start the new I2C transaction. This will cause
-						 * subsequent I2C interrupts that will eventually
-						 * complete the transaction.
-						 *
-						 * NOTE: ucI2C_busy will remain == pdTRUE
-						 */
-						WRITE(I2C0CONSET, 0x20);
-					}
-					else {
-						/* No pending I2C transactions
-						 * - the I2C request queue was empty
-						 *
-						 * Clear the ucI2C_busy flag.
-						 */
-						ucI2C_busy = pdFALSE;
-					} /* end if (ucI2C_pending == pdTRUE) */
+				}
+				else if (ucI2C_state == i2cENGINE_BUSY) {
+					/* The transaction continues. Give the next I2C0 state
+					 * transition a fresh watchdog interval.
+					 */
+					prvI2C_ArmWatchdog();
 
-				} /* end if( (ucI2C_cstate == I2C_STOP) || (ucI2C_cstate == I2C_ERROR_STOP) ) */
+				} /* end if( (ucI2C_cstate == I2C_STOP) || ... ) */
 
 
 				/* The I2C interrupt for any cases above has been serviced.
@@ -779,22 +1189,142 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
 				 *
 				 * Assume that this is a "spurious" VIC interrupt.
 				 *
+				 * This is also the path taken when the only reason for the
+				 * interrupt was the submission doorbell.
+				 *
 				 * There is no code to execute here.
 				 */
 			} /* if(READ(I2C0CONSET) & 0x08) */
 
+			/* Handle a bus watchdog expiry.
+			 *
+			 * Timer3 expired before the I2C0 controller reported the next
+			 * state transition (e.g. a slave is holding SCL low). Abort the
+			 * transaction, recover the bus, and fail the request with
+			 * I2C_TIMEOUT so that the queued requests behind it can run.
+			 *
+			 * NOTE: ucI2C_Expired is re-checked after the SI service above
+			 *       because servicing a late state transition re-arms the
+			 *       watchdog and clears the flag.
+			 */
+			if (ucI2C_Expired == pdTRUE) {
+
+				ucI2C_Expired = pdFALSE;
+
+				if (ucI2C_state == i2cENGINE_BUSY) {
+					prvI2C_Recover();
+					ucI2C_cstate = I2C_TIMEOUT;
+					ucI2C_Slave = pdFALSE;
+					ulI2C_Timeouts++;
+					prvI2C_Finish(pxI2C, I2C_TIMEOUT);
+				}
+				else if (ucI2C_Slave == pdTRUE) {
+					/* A Host Notify sender stopped part way through its
+					 * message. STO in slave mode returns I2C0 to the not
+					 * addressed state without touching the bus; AA keeps
+					 * our own address recognised. Dispatching resumes.
+					 */
+					ucI2C_Slave = pdFALSE;
+					WRITE(I2C0CONSET, 0x14);
+					ulI2C_SlaveTimeouts++;
+				}
+			} /* end if (ucI2C_Expired == pdTRUE) */
+
+			/* Handle SMBALERT#.
+			 *
+			 * The EINT2 ISR masked the alert line and flagged it. Queue an
+			 * Alert Response Address read; the device that asserted
+			 * SMBALERT# answers with its own address and releases the line
+			 * (see prvI2C_AlertDone).
+			 */
+			if (ucI2C_AlertPending == pdTRUE) {
+
+				ucI2C_AlertPending = pdFALSE;
+
+				xI2C_Alert.opcode		= I2C_ReceiveByte;
+				xI2C_Alert.addr			= I2C_ARA_ADDR;
+				xI2C_Alert.pxComplete	= prvI2C_AlertDone;
+				xI2C_Alert.cancel		= pdFALSE;
+				ucI2C_Continue(&xI2C_Alert);
+			} /* end if (ucI2C_AlertPending == pdTRUE) */
+
+			/* Collect newly queued requests and return cancelled ones
+			 * straight away, even while the bus is busy. Then run at the
+			 * priority of the highest-priority requester with work left
+			 * (atomically with the drain, see prvI2C_Inherit).
+			 */
+			vTaskSuspendAll();
+			prvI2C_Drain();
+			prvI2C_Inherit((ucI2C_state == i2cENGINE_BUSY) ? pxI2C : NULL);
+			xTaskResumeAll();
+
+			/* Dispatch the next request.
+			 *
+			 * If the engine is idle, pick the request with the earliest
+			 * deadline (or the oldest, see prvI2C_Select) and start it. This is the only place a new
+			 * I2C transaction is started. The START condition will cause a
+			 * subsequent I2C interrupt (case 0x08) that begins the
+			 * transaction.
+			 *
+			 * I2C0 is powered up for the request if it was gated off, and
+			 * gated off once there is nothing left to do (unless it must
+			 * listen for Host Notify as a slave).
+			 *
+			 * Nothing is started while another master is using the bus to
+			 * address us as a slave.
+			 */
+			if ((ucI2C_state == i2cENGINE_IDLE) && (ucI2C_Slave == pdFALSE)) {
+
+				pxI2C = prvI2C_Select();
+
+				if (pxI2C != NULL) {
+					/* A prepared request is performed straight from its
+					 * (flash) descriptor, otherwise from the request's own
+					 * opcode, addr and comm.
+					 */
+					if (pxI2C->pxPrepared != NULL) {
+						pxI2C_Op = pxI2C->pxPrepared;
+					}
+					else {
+						xI2C_Op.opcode	= pxI2C->opcode;
+						xI2C_Op.addr	= pxI2C->addr;
+						xI2C_Op.comm	= pxI2C->comm;
+						pxI2C_Op = &xI2C_Op;
+					}
+
+					ucI2C_sccb = (unsigned portCHAR)
+						((ucI2C_SCCBMap[(pxI2C_Op->addr >> 3) & 0x0F] >>
+						  (pxI2C_Op->addr & 0x07)) & 0x01);
+
+					if (ucI2C_Powered == pdFALSE) {
+						prvI2C_PowerUp();
+					}
+					ucI2C_state = i2cENGINE_BUSY;
+					ucI2C_abort = pdFALSE;
+					ulI2C_BusStart = READ(T3TC);
+					prvI2C_ArmWatchdog();
+					WRITE(I2C0CONSET, 0x20);
+				}
+				else if ((ucI2C_Powered == pdTRUE) && (ucI2C_Notify == pdFALSE)) {
+					prvI2C_PowerDown();
+				}
+			} /* end if ((ucI2C_state == i2cENGINE_IDLE) && (ucI2C_Slave == pdFALSE)) */
+
 			/* Un-mask VIC I2C0 interrupt.
 			 *
 			 * This will enable subsequent I2C0 interrupts.
 			 */
-			WRITE(VICIntEnClear, 0x00000200);
+			WRITE(VICIntEnable, i2cVIC_I2C0);
 
 			/* Done servicing I2C0 interrupt */
 
-			} /* End if (xSemaphoreTake(xI2CSemaphore, (portTickType) 1) == pdTRUE) */
-
-		/* Execute a delay to yield to other tasks */
-		vTaskDelay((portTickType) 1);
+			} /* End if (xSemaphoreTake(xI2CSemaphore, xI2C_Block) == pdTRUE) */
+			else {
+				/* A request held back by its bandwidth budget can go in the
+				 * new period: ring the doorbell for another dispatch pass.
+				 */
+				WRITE(VICSoftInt, i2cVIC_I2C0);
+			}
 
 	} /* End for(;;;) */
 }
@@ -803,12 +1333,15 @@ void vI2CTask( void* pvParameters __attribute__ ((unused)))
  * vI2C_Init() *
  ***************
  * I2C initialization code called by main
- * - uxQueueLength specifies the number of entries in the request queue
  */
-void vI2C_Init( unsigned portBASE_TYPE uxQueueLength )
+void vI2C_Init( void )
 {
 	/* Declare enternal variables */
 	extern void ( vI2C_ISR_Wrapper )(void);
+	extern void ( vI2C_TimerISR )(void);
+
+	/* Declare local variables */
+	unsigned portBASE_TYPE uxIndex;
 
 	portENTER_CRITICAL();
 
@@ -818,23 +1351,14 @@ void vI2C_Init( unsigned portBASE_TYPE uxQueueLength )
 	 */
 	WRITE(PINSEL0, (READ(PINSEL0) | 0x50));
 
-	/* Clear I2C0 register */
-	WRITE(I2C0CONCLR, 0x7C);
-
-	/* Configure the I2C0 clock for 100 KHz operation
-	 * - 10 us period (5 us high, 5 us low)
-	 * - CPU clock (Cclk) = 58.9824 MHz
-	 * - Pclk = Cclk
-	 * 		5 us ~= 295 / 58.9824 MHz
+	/* Power up and configure the I2C0 controller. The engine gates it off
+	 * again as soon as it finds the request queue empty.
 	 */
-	WRITE(I2C0SCLH, 295);
-	WRITE(I2C0SCLL, 295);
+	prvI2C_PowerUp();
+	ulI2C_PowerUps = 0;
 
-	/* Set I2C0 master enable */
-	WRITE(I2C0CONSET, 0x40);
-
-	/* Clear I2C0 interrupt (just in case) */
-	WRITE(I2C0CONCLR, 0x8);
+	/* I2C1 is not used, leave it powered down */
+	WRITE(PCONP, (READ(PCONP) & ~i2cPCONP_I2C1));
 
 	/* Configure the Vectored Interrupt Controller for I2C1 interrupt
 	 * - VIC channel 9 = I2C0 interrupt
@@ -853,106 +1377,608 @@ void vI2C_Init( unsigned portBASE_TYPE uxQueueLength )
 	 */
 	WRITE(VICIntEnable, (READ (VICIntEnable) | 0x00000200) );
 
-	/* Initialize I2C busy flag = idle */
-	ucI2C_busy = pdFALSE;
+	/* Configure Timer3 as the per-byte bus watchdog
+	 * - power up Timer3, PCONP[23] = 1
+	 * - timer mode, no prescale: T3TC counts Pclk cycles and runs freely
+	 *   (it is never reset, so the watchdog is armed by moving T3MR0)
+	 * - match 0 interrupt is enabled only while a transaction is active
+	 */
+	WRITE(PCONP, (READ(PCONP) | i2cPCONP_TIMER3));
+	WRITE(T3TCR, 0x02);
+	WRITE(T3CTCR, 0x00);
+	WRITE(T3PR, 0x00000000);
+	WRITE(T3MCR, 0x0000);
+	WRITE(T3IR, 0xFF);
+	WRITE(T3TCR, 0x01);
+
+	/* Configure the Vectored Interrupt Controller for the Timer3 interrupt
+	 * - VIC channel 27 = Timer3 interrupt
+	 * - Use VICVectAddr2 / VICVectCntl2
+	 * 		Set VIC IRQ "slot" enable, bit[5] = 1
+	 * 		Set VIC IRQ channel = 27 (Timer3), bits[4:0] = 11011
+	 *
+	 * 		bits[5:0] = 0x3B
+	 */
+	WRITE(VICVectAddr2, (unsigned portBASE_TYPE) vI2C_TimerISR);
+	WRITE(VICVectCntl2, 0x3B);
+	WRITE(VICIntEnable, (READ (VICIntEnable) | i2cVIC_TIMER3) );
+
+	/* Default watchdog limit = SMBus tTIMEOUT (min) */
+	vI2C_SetTimeout(I2C_TIMEOUT_US);
+	ucI2C_Expired = pdFALSE;
+
+	/* Initialize I2C engine state = idle */
+	ucI2C_state = i2cENGINE_IDLE;
+
+	/* Initialize the (empty) I2C request queue */
+	xI2C_Stub.pxNext = NULL;
+	pxI2C_Head = &xI2C_Stub;
+	pxI2C_Tail = &xI2C_Stub;
+
+	/* Thread every pool descriptor onto the free list */
+	pxI2C_Free = NULL;
+	for (uxIndex = 0; uxIndex < I2C_POOL_SIZE; uxIndex++) {
+		xI2C_Pool[uxIndex].flags = I2C_FLAG_POOL;
+		xI2C_Pool[uxIndex].pxNext = pxI2C_Free;
+		pxI2C_Free = &xI2C_Pool[uxIndex];
+	}
 
 	portEXIT_CRITICAL();
 
-	/* Create I2C request queue
-	 * - one entry per task that issues I2C transaction requests
-	 */
-	pxI2C_RQ = xQueueCreate( uxQueueLength, sizeof( xI2C_struct * ) );
-
 	/* Create I2C semaphore
 	 * - i2cISR.c "gives" the semaphore to i2c.c which "handles" the
 	 *   interrupt (deferred interrupt handler). The semaphore is "taken" by
 	 *   i2c.c which then services the interrupt condition.
 	 */
+	vI2C_SignalInit(&xI2C_SlotSignal);
 	vSemaphoreCreateBinary( xI2CSemaphore );
 
 
 } /* End of vI2C_Init */
 
-/*****************
- * ucI2C_Quick() *
- ****************/
-unsigned portCHAR ucI2C_Quick (xI2C_struct *pxI2C,
-							   unsigned portCHAR addr,
-							   unsigned portCHAR data)
+/*********************
+ * vI2C_SetTimeout() *
+ *********************
+ * Set the bus watchdog limit for a single I2C0 state transition
+ * - I2C_TIMEOUT_US (SMBus tTIMEOUT, 25 ms) by default; a tighter limit
+ *   frees a stalled bus sooner
+ * - limited to I2C_TIMEOUT_MAX_US (SMBus tTIMEOUT max, 35 ms)
+ * - at least one byte time at the configured bit rate (i2cBYTE_CYCLES);
+ *   a shorter limit would fire during every healthy transfer
+ */
+void vI2C_SetTimeout( unsigned portLONG ulMicroseconds )
 {
+	unsigned portLONG ulCycles;
 
-	/* Initialize parameters for request */
-	pxI2C->opcode	= I2C_Quick;		/* I2C transaction code */
-	pxI2C->addr		= addr;		        /* Address (before left shift) */
-	pxI2C->data[0]	= data;				/* Write data bit (low bit only) */
+	if (ulMicroseconds > I2C_TIMEOUT_MAX_US) {
+		ulMicroseconds = I2C_TIMEOUT_MAX_US;
+	}
 
-	/* Queue I2C transaction request and wait for completion */
-	prvI2C_Transaction(pxI2C);
+	/* Pclk cycles = us * 58.9824 (kept within 32 bits) */
+	ulCycles = (ulMicroseconds * (configCPU_CLOCK_HZ / 10000)) / 100;
 
-	/* I2C transaction complete, return status */
-	return pxI2C->status;
+	if (ulCycles < i2cBYTE_CYCLES) {
+		ulCycles = i2cBYTE_CYCLES;
+	}
 
-} /*end ucI2C_Quick */
+	ulI2C_Timeout = ulCycles;
 
-/********************
- * ucI2C_SendByte() *
- *******************/
-unsigned portCHAR ucI2C_SendByte (xI2C_struct *pxI2C,
-								  unsigned portCHAR addr,
-								  unsigned portCHAR data)
-{
+} /*end vI2C_SetTimeout */
 
-	/* Initialize parameters for request */
-	pxI2C->opcode	= I2C_SendByte;		/* I2C transaction code */
-	pxI2C->addr		= addr;		        /* Address (before left shift) */
-	pxI2C->data[0]	= data;				/* Write data byte */
+/*****************
+ * prvI2C_Finish *
+ *****************
+ * Complete the request on the bus (called by the engine)
+ * - stop the bus watchdog and charge the bus time to the requester
+ * - return the status to the requesting task and return the completion
+ *   (or return a fire-and-forget pool descriptor to the pool)
+ * - leave the engine idle so the dispatch code starts the next request
+ */
+static void prvI2C_Finish( xI2C_struct *pxI2C, unsigned portCHAR ucStatus )
+{
+	unsigned portLONG ulUsed;
+	unsigned portBASE_TYPE uxIndex;
 
-	/* Queue I2C transaction request and wait for completion */
-	prvI2C_Transaction(pxI2C);
+	prvI2C_DisarmWatchdog();
 
-	/* I2C transaction complete, return status */
-	return pxI2C->status;
+	/* Charge the bus time to the requester's budget */
+	ulUsed = READ(T3TC) - ulI2C_BusStart;
 
-} /*end ucI2C_SendByte */
+	for (uxIndex = 0; uxIndex < I2C_BUDGETS; uxIndex++) {
+		if ((xI2C_Budgets[uxIndex].ulReserved != 0) &&
+			(xI2C_Budgets[uxIndex].reqID == pxI2C->reqID)) {
+			xI2C_Budgets[uxIndex].lTokens -= (portLONG) ulUsed;
+			xI2C_Budgets[uxIndex].ulUsed += ulUsed;
+			break;
+		}
+	}
 
-/***********************
- * ucI2C_ReceiveByte() *
- **********************/
-unsigned portCHAR ucI2C_ReceiveByte (xI2C_struct *pxI2C,
-									 unsigned portCHAR addr)
-{
-	/* Initialize parameters for request */
-	pxI2C->opcode	= I2C_ReceiveByte;	/* I2C transaction code */
-	pxI2C->addr		= addr;		        /* Address (before left shift) */
+	/* Keep acknowledging our own slave address (Host Notify). Master
+	 * receive transactions clear AA to NACK their last data byte.
+	 */
+	if (ucI2C_Notify == pdTRUE) {
+		WRITE(I2C0CONSET, 0x04);
+	}
 
-	/* Queue I2C transaction request and wait for completion */
-	prvI2C_Transaction(pxI2C);
+	prvI2C_Complete(pxI2C, ucStatus);
 
-	/* I2C transaction complete, return status */
-	return pxI2C->status;
+	/* Done with the prior I2C transaction. The next request (if any) is
+	 * started by the dispatch code in vI2CTask.
+	 */
+	ucI2C_state = i2cENGINE_IDLE;
 
-} /*end ucI2C_ReceiveByte */
+} /*end prvI2C_Finish */
 
-/*********************
- * ucI2C_WriteByte() *
- ********************/
-unsigned portCHAR ucI2C_WriteByte (xI2C_struct *pxI2C,
-								   unsigned portCHAR addr,
-								   unsigned portCHAR cmd,
-								   unsigned portCHAR data)
+/*******************
+ * prvI2C_Complete *
+ *******************
+ * Return a request to its requester with ucStatus (called by the engine)
+ * - used by prvI2C_Finish, and directly for requests that are failed or
+ *   cancelled before they reach the bus
+ * - the engine holds no reference to the request afterwards
+ */
+static void prvI2C_Complete( xI2C_struct *pxI2C, unsigned portCHAR ucStatus )
 {
+	unsigned portLONG ulStart;
 
-	/* Initialize parameters for request */
-	pxI2C->opcode	= I2C_WriteByte;	/* I2C transaction code */
-	pxI2C->addr		= addr;		        /* Address (before left shift) */
-	pxI2C->comm		= cmd;		        /* Command byte (register offset) */
-	pxI2C->data[0]	= data;				/* Write data byte */
+	pxI2C->status = ucStatus;
 
-	/* Queue I2C transaction request and wait for completion */
-	prvI2C_Transaction(pxI2C);
+	if ((pxI2C->flags & I2C_FLAG_DEADLINE) && (ucStatus != I2C_EXPIRED) &&
+		((portLONG) (xTaskGetTickCount() - pxI2C->xDeadline) > 0)) {
+		ulI2C_DeadlineLate++;
+	}
 
-	/* I2C transaction complete, return status */
-	return pxI2C->status;
+	/* Run the request's completion handler (engine context). If it has
+	 * kept the request, e.g. continued it with a follow-up transaction,
+	 * the requester is not told about this step.
+	 */
+	if ((pxI2C->pxComplete != NULL) && (pxI2C->pxComplete(pxI2C) == pdTRUE)) {
+		return;
+	}
+
+	/* Return the completion for the I2C transaction request
+	 * - set the request's done flag and wake the requesting task if it is
+	 *   blocked in ucI2C_Wait()
+	 * - a fire-and-forget pool descriptor goes straight back to the pool
+	 *   instead
+	 */
+	if (pxI2C->flags & I2C_FLAG_RELEASE) {
+		vI2C_Release(pxI2C);
+	}
+	else {
+		ulStart = ulCYCLES_NOW();
+		prvI2C_Signal(pxI2C);
+		xI2C_Cost.ulEngineSignal = ulCyclesSince(ulStart);
+	}
+
+} /*end prvI2C_Complete */
+
+/**********************
+ * prvI2C_ArmWatchdog *
+ **********************
+ * (Re)start the bus watchdog: Timer3 match 0 fires ulI2C_Timeout cycles
+ * from now unless the watchdog is re-armed or disarmed first.
+ *
+ * NOTE: the match register is moved BEFORE the flag is cleared, so an
+ *       expiry of the previous interval that races with re-arming is
+ *       discarded rather than aborting a transaction that just made
+ *       progress.
+ */
+static void prvI2C_ArmWatchdog( void )
+{
+	WRITE(T3MR0, READ(T3TC) + ulI2C_Timeout);
+	WRITE(T3MCR, 0x0001);
+	ucI2C_Expired = pdFALSE;
+
+} /*end prvI2C_ArmWatchdog */
+
+/*************************
+ * prvI2C_DisarmWatchdog *
+ *************************/
+static void prvI2C_DisarmWatchdog( void )
+{
+	WRITE(T3MCR, 0x0000);
+	ucI2C_Expired = pdFALSE;
+
+} /*end prvI2C_DisarmWatchdog */
+
+/******************
+ * prvI2C_Recover *
+ ******************
+ * Abort the current transaction and return the bus to the idle state
+ *
+ * 1) disable the I2C0 controller (drops STA/SI/AA)
+ * 2) take over SCL0/SDA0 as open-drain GPIO (drive low = output, release
+ *    = input; the bus pull-ups provide the high level)
+ * 3) clock SCL up to 9 times until a slave stuck mid-byte releases SDA
+ * 4) generate a STOP condition
+ * 5) give the pins back to I2C0 and re-enable the controller
+ *
+ * A slave that holds SCL low is not affected by 3) and 4); SMBus slaves
+ * release the bus by themselves after tTIMEOUT, and a device that does not
+ * will simply time out the next request as well.
+ */
+static void prvI2C_Recover( void )
+{
+	unsigned portBASE_TYPE uxPulse;
+
+	/* Disable the I2C0 controller: clear I2EN, STA, SI, AA */
+	WRITE(I2C0CONCLR, 0x6C);
+
+	/* SCL0 and SDA0 as GPIO inputs (released), output level low
+	 * - PINSEL0[7:4] = 0000
+	 */
+	portENTER_CRITICAL();
+	WRITE(FIODIR, (READ(FIODIR) & ~(i2cSCL_PIN | i2cSDA_PIN)));
+	WRITE(PINSEL0, (READ(PINSEL0) & ~0x000000F0));
+	portEXIT_CRITICAL();
+	WRITE(FIOCLR, (i2cSCL_PIN | i2cSDA_PIN));
+
+	/* Clock out the byte a slave may still be driving */
+	for (uxPulse = 0; (uxPulse < 9) && !(READ(FIOPIN) & i2cSDA_PIN); uxPulse++) {
+		portENTER_CRITICAL();
+		WRITE(FIODIR, (READ(FIODIR) | i2cSCL_PIN));
+		portEXIT_CRITICAL();
+		prvI2C_Delay(i2cHALF_BIT);
+
+		portENTER_CRITICAL();
+		WRITE(FIODIR, (READ(FIODIR) & ~i2cSCL_PIN));
+		portEXIT_CRITICAL();
+		prvI2C_Delay(i2cHALF_BIT);
+	}
+
+	/* STOP: SDA rises while SCL is high */
+	portENTER_CRITICAL();
+	WRITE(FIODIR, (READ(FIODIR) | i2cSDA_PIN));
+	portEXIT_CRITICAL();
+	prvI2C_Delay(i2cHALF_BIT);
+
+	portENTER_CRITICAL();
+	WRITE(FIODIR, (READ(FIODIR) & ~i2cSDA_PIN));
+	WRITE(PINSEL0, (READ(PINSEL0) | 0x50));
+	portEXIT_CRITICAL();
+	prvI2C_Delay(i2cHALF_BIT);
+
+	/* Clear any stale interrupt and re-enable the I2C0 controller */
+	WRITE(I2C0CONCLR, 0x08);
+	WRITE(I2C0CONSET, 0x40);
+
+} /*end prvI2C_Recover */
+
+/******************
+ * prvI2C_PowerUp *
+ ******************
+ * Power up I2C0 (PCONP[7]) and (re)configure the controller
+ */
+static void prvI2C_PowerUp( void )
+{
+	unsigned portLONG ulStart = ulCYCLES_NOW();
+
+	portENTER_CRITICAL();
+	WRITE(PCONP, (READ(PCONP) | i2cPCONP_I2C0));
+	portEXIT_CRITICAL();
+
+	/* Clear I2C0 register */
+	WRITE(I2C0CONCLR, 0x7C);
+
+	/* Configure the I2C0 clock for 100 KHz operation
+	 * - 10 us period (5 us high, 5 us low)
+	 * - CPU clock (Cclk) = 58.9824 MHz
+	 * - Pclk = Cclk
+	 * 		5 us ~= 295 / 58.9824 MHz (i2cHALF_BIT)
+	 */
+	WRITE(I2C0SCLH, i2cHALF_BIT);
+	WRITE(I2C0SCLL, i2cHALF_BIT);
+
+	/* Set I2C0 master enable */
+	WRITE(I2C0CONSET, 0x40);
+
+	/* Clear I2C0 interrupt (just in case) */
+	WRITE(I2C0CONCLR, 0x8);
+
+	/* Answer as the SMBus Host (Host Notify) if enabled
+	 * - I2C0ADR[7:1] = own slave address, bit[0] = 0 (no general call)
+	 * - AA = 1 to acknowledge our own slave address
+	 */
+	if (ucI2C_Notify == pdTRUE) {
+		WRITE(I2C0ADR, (I2C_HOST_ADDR << 1));
+		WRITE(I2C0CONSET, 0x04);
+	}
+
+	ucI2C_Powered = pdTRUE;
+	ulI2C_PowerUps++;
+	ulI2C_PowerUpCycles = ulCyclesSince(ulStart);
+
+} /*end prvI2C_PowerUp */
+
+/********************
+ * prvI2C_PowerDown *
+ ********************
+ * Disable the I2C0 controller and gate its clock off (PCONP[7])
+ *
+ * NOTE: VIC channel 9 stays enabled; it also carries the submission
+ *       doorbell (VICSoftInt) that powers I2C0 up again.
+ */
+static void prvI2C_PowerDown( void )
+{
+	WRITE(I2C0CONCLR, 0x6C);
+
+	portENTER_CRITICAL();
+	WRITE(PCONP, (READ(PCONP) & ~i2cPCONP_I2C0));
+	portEXIT_CRITICAL();
+
+	ucI2C_Powered = pdFALSE;
+
+} /*end prvI2C_PowerDown */
+
+/******************
+ * vI2C_SetSCCB() *
+ ******************
+ * Mark the device at addr as an SCCB (OmniVision camera bus) device, or
+ * as a plain I2C device again (xEnable = pdFALSE)
+ *
+ * For an SCCB device the engine
+ * - ignores the ninth bit (ACK/NACK) of every byte it writes
+ * - performs READ BYTE / READ WORD as a write of the command byte, STOP,
+ *   then a read (SCCB does not support REPEATED-START)
+ */
+void vI2C_SetSCCB( unsigned portCHAR addr, portBASE_TYPE xEnable )
+{
+	unsigned portCHAR ucBit = (unsigned portCHAR) (0x01 << (addr & 0x07));
+
+	portENTER_CRITICAL();
+
+	if (xEnable == pdFALSE) {
+		ucI2C_SCCBMap[(addr >> 3) & 0x0F] &= (unsigned portCHAR) ~ucBit;
+	}
+	else {
+		ucI2C_SCCBMap[(addr >> 3) & 0x0F] |= ucBit;
+	}
+
+	portEXIT_CRITICAL();
+
+} /*end vI2C_SetSCCB */
+
+/****************************
+ * ucI2C_SetEventHandler() *
+ ****************************
+ * Register the handler for SMBus events (SMBALERT#, Host Notify) raised by
+ * the device at addr, or remove it (pxHandler = NULL)
+ * - returns pdFALSE if the handler table is full
+ * - handlers run in the I2C engine task and must not block
+ */
+unsigned portCHAR ucI2C_SetEventHandler( unsigned portCHAR addr, pxI2C_EventHandler pxHandler )
+{
+	unsigned portBASE_TYPE uxIndex;
+	unsigned portBASE_TYPE uxFree = I2C_EVENT_HANDLERS;
+
+	for (uxIndex = 0; uxIndex < I2C_EVENT_HANDLERS; uxIndex++) {
+		if ((xI2C_Handlers[uxIndex].pxHandler != NULL) &&
+			(xI2C_Handlers[uxIndex].addr == addr)) {
+			break;
+		}
+		if ((xI2C_Handlers[uxIndex].pxHandler == NULL) &&
+			(uxFree == I2C_EVENT_HANDLERS)) {
+			uxFree = uxIndex;
+		}
+	}
+
+	if (uxIndex == I2C_EVENT_HANDLERS) {
+		if ((uxFree == I2C_EVENT_HANDLERS) || (pxHandler == NULL)) {
+			return (unsigned portCHAR) (pxHandler == NULL);
+		}
+		uxIndex = uxFree;
+	}
+
+	/* Write the address before the handler: the engine only looks at
+	 * entries with a handler.
+	 */
+	xI2C_Handlers[uxIndex].pxHandler = NULL;
+	xI2C_Handlers[uxIndex].addr = addr;
+	xI2C_Handlers[uxIndex].pxHandler = pxHandler;
+
+	return pdTRUE;
+
+} /*end ucI2C_SetEventHandler */
+
+/**********************
+ * vI2C_EnableAlert() *
+ **********************
+ * Enable SMBALERT# on P0.15 (EINT2, active low, level sensitive)
+ * - call after vI2C_Init()
+ */
+void vI2C_EnableAlert( void )
+{
+	extern void ( vI2C_AlertISR )(void);
+
+	portENTER_CRITICAL();
+
+	/* P0.15 = EINT2, PINSEL0[31:30] = 10 */
+	WRITE(PINSEL0, ((READ(PINSEL0) & ~0xC0000000) | 0x80000000));
+
+	/* Level sensitive (EXTMODE[2] = 0), active low (EXTPOLAR[2] = 0) */
+	WRITE(EXTMODE, (READ(EXTMODE) & ~i2cEINT2));
+	WRITE(EXTPOLAR, (READ(EXTPOLAR) & ~i2cEINT2));
+	WRITE(EXTINT, i2cEINT2);
+
+	/* Configure the Vectored Interrupt Controller for the EINT2 interrupt
+	 * - VIC channel 16 = EINT2
+	 * - Use VICVectAddr3 / VICVectCntl3
+	 * 		Set VIC IRQ "slot" enable, bit[5] = 1
+	 * 		Set VIC IRQ channel = 16 (EINT2), bits[4:0] = 10000
+	 *
+	 * 		bits[5:0] = 0x30
+	 */
+	WRITE(VICVectAddr3, (unsigned portBASE_TYPE) vI2C_AlertISR);
+	WRITE(VICVectCntl3, 0x30);
+	WRITE(VICIntEnable, i2cVIC_EINT2);
+
+	portEXIT_CRITICAL();
+
+} /*end vI2C_EnableAlert */
+
+/***************************
+ * vI2C_EnableHostNotify() *
+ ***************************
+ * Listen for SMBus Host Notify messages at I2C_HOST_ADDR
+ * - call after vI2C_Init() and before the scheduler is started
+ * - I2C0 then stays powered while idle so it can be addressed
+ */
+void vI2C_EnableHostNotify( void )
+{
+	ucI2C_Notify = pdTRUE;
+
+	WRITE(I2C0ADR, (I2C_HOST_ADDR << 1));
+	WRITE(I2C0CONSET, 0x04);
+
+} /*end vI2C_EnableHostNotify */
+
+/****************
+ * prvI2C_Event *
+ ****************
+ * Dispatch an SMBus event to the handler registered for addr
+ */
+static void prvI2C_Event( unsigned portCHAR addr, unsigned portCHAR event, unsigned portSHORT data )
+{
+	unsigned portBASE_TYPE uxIndex;
+	pxI2C_EventHandler pxHandler;
+
+	for (uxIndex = 0; uxIndex < I2C_EVENT_HANDLERS; uxIndex++) {
+		pxHandler = xI2C_Handlers[uxIndex].pxHandler;
+		if ((pxHandler != NULL) && (xI2C_Handlers[uxIndex].addr == addr)) {
+			pxHandler(addr, event, data);
+			return;
+		}
+	}
+
+} /*end prvI2C_Event */
+
+/********************
+ * prvI2C_AlertDone *
+ ********************
+ * Alert Response Address read completed
+ * - data[0] bits[7:1] = address of the device that asserted SMBALERT#
+ * - SMBALERT# is re-enabled; if another device still asserts it the EINT2
+ *   interrupt fires again (level sensitive) and the next device is read
+ * - completion handler of xI2C_Alert (engine context)
+ */
+static portBASE_TYPE prvI2C_AlertDone( xI2C_struct *pxI2C )
+{
+	if (pxI2C->status == I2C_STOP) {
+		ucI2C_AlertFailures = 0;
+		ulI2C_Alerts++;
+		prvI2C_Event((unsigned portCHAR) (pxI2C->data[0] >> 1),
+					 I2C_EVENT_ALERT, (unsigned portSHORT) pxI2C->data[0]);
+	}
+	else {
+		ucI2C_AlertFailures++;
+	}
+
+	/* Clear the EINT2 flag and unmask it at the VIC, unless the line keeps
+	 * failing (then it stays masked rather than flooding the bus).
+	 */
+	if (ucI2C_AlertFailures < i2cALERT_RETRIES) {
+		WRITE(EXTINT, i2cEINT2);
+		WRITE(VICIntEnable, i2cVIC_EINT2);
+	}
+
+	return pdFALSE;
+
+} /*end prvI2C_AlertDone */
+
+/****************
+ * prvI2C_Delay *
+ ****************
+ * Busy-wait for ulCycles Pclk cycles (Timer3 is free running)
+ */
+static void prvI2C_Delay( unsigned portLONG ulCycles )
+{
+	unsigned portLONG ulStart = READ(T3TC);
+
+	while ((READ(T3TC) - ulStart) < ulCycles);
+
+} /*end prvI2C_Delay */
+
+/*****************
+ * ucI2C_Quick() *
+ ****************/
+unsigned portCHAR ucI2C_Quick (xI2C_struct *pxI2C,
+							   unsigned portCHAR addr,
+							   unsigned portCHAR data)
+{
+
+	/* Initialize parameters for request */
+	pxI2C->opcode	= I2C_Quick;		/* I2C transaction code */
+	pxI2C->addr		= addr;		        /* Address (before left shift) */
+	pxI2C->data[0]	= data;				/* Write data bit (low bit only) */
+
+	/* Queue I2C transaction request and wait for completion */
+	prvI2C_Transaction(pxI2C);
+
+	/* I2C transaction complete, return status */
+	return pxI2C->status;
+
+} /*end ucI2C_Quick */
+
+/********************
+ * ucI2C_SendByte() *
+ *******************/
+unsigned portCHAR ucI2C_SendByte (xI2C_struct *pxI2C,
+								  unsigned portCHAR addr,
+								  unsigned portCHAR data)
+{
+
+	/* Initialize parameters for request */
+	pxI2C->opcode	= I2C_SendByte;		/* I2C transaction code */
+	pxI2C->addr		= addr;		        /* Address (before left shift) */
+	pxI2C->data[0]	= data;				/* Write data byte */
+
+	/* Queue I2C transaction request and wait for completion */
+	prvI2C_Transaction(pxI2C);
+
+	/* I2C transaction complete, return status */
+	return pxI2C->status;
+
+} /*end ucI2C_SendByte */
+
+/***********************
+ * ucI2C_ReceiveByte() *
+ **********************/
+unsigned portCHAR ucI2C_ReceiveByte (xI2C_struct *pxI2C,
+									 unsigned portCHAR addr)
+{
+	/* Initialize parameters for request */
+	pxI2C->opcode	= I2C_ReceiveByte;	/* I2C transaction code */
+	pxI2C->addr		= addr;		        /* Address (before left shift) */
+
+	/* Queue I2C transaction request and wait for completion */
+	prvI2C_Transaction(pxI2C);
+
+	/* I2C transaction complete, return status */
+	return pxI2C->status;
+
+} /*end ucI2C_ReceiveByte */
+
+/*********************
+ * ucI2C_WriteByte() *
+ ********************/
+unsigned portCHAR ucI2C_WriteByte (xI2C_struct *pxI2C,
+								   unsigned portCHAR addr,
+								   unsigned portCHAR cmd,
+								   unsigned portCHAR data)
+{
+
+	/* Initialize parameters for request */
+	pxI2C->opcode	= I2C_WriteByte;	/* I2C transaction code */
+	pxI2C->addr		= addr;		        /* Address (before left shift) */
+	pxI2C->comm		= cmd;		        /* Command byte (register offset) */
+	pxI2C->data[0]	= data;				/* Write data byte */
+
+	/* Queue I2C transaction request and wait for completion */
+	prvI2C_Transaction(pxI2C);
+
+	/* I2C transaction complete, return status */
+	return pxI2C->status;
 
 } /*end ucI2C_WriteByte */
 
@@ -1022,6 +2048,980 @@ unsigned portCHAR ucI2C_ReadWord (xI2C_struct *pxI2C,
 } /*end ucI2C_ReadWord */
 
 
+/**********************
+ * ucI2C_WriteBurst() *
+ **********************
+ * Write len bytes from pucData to consecutive registers starting at cmd
+ * (for devices that auto-increment the register address)
+ * - pucData must stay valid until the transaction completes
+ */
+unsigned portCHAR ucI2C_WriteBurst (xI2C_struct *pxI2C,
+									unsigned portCHAR addr,
+									unsigned portCHAR cmd,
+									unsigned portCHAR *pucData,
+									unsigned portCHAR len)
+{
+	/* Initialize parameters for request */
+	pxI2C->opcode	= I2C_WriteBurst;	/* Driver-level burst opcode */
+	pxI2C->addr		= addr;				/* Address (before left shift) */
+	pxI2C->comm		= cmd;				/* First register */
+	pxI2C->pucBuf	= pucData;			/* Write data */
+	pxI2C->ucBufLen	= len;				/* Number of write data bytes */
+
+	/* Queue I2C transaction request and wait for completion */
+	prvI2C_Transaction(pxI2C);
+
+	/* I2C transaction complete, return status */
+	return pxI2C->status;
+
+} /*end ucI2C_WriteBurst */
+
+/****************
+ * ucI2C_Scan() *
+ ****************
+ * Probe every 7-bit address from first to last (inclusive) with a quick
+ * write and record which addresses ACK in the caller's presence map
+ * (I2C_SCAN_MAP_SIZE bytes). The sweep is executed as a single request;
+ * bits outside [first, last] are left untouched.
+ */
+unsigned portCHAR ucI2C_Scan (xI2C_struct *pxI2C,
+							  unsigned portCHAR first,
+							  unsigned portCHAR last,
+							  unsigned portCHAR *pucMap)
+{
+	/* Reject an empty or out-of-range sweep without touching the bus */
+	if ((first > last) || (last > 0x7F)) {
+		pxI2C->status = I2C_ERROR;
+		return pxI2C->status;
+	}
+
+	/* Initialize parameters for request */
+	pxI2C->opcode	= I2C_Scan;			/* Driver-level scan opcode */
+	pxI2C->addr		= first;			/* First address to probe */
+	pxI2C->comm		= last;				/* Last address to probe */
+	pxI2C->pucBuf	= pucMap;			/* Presence map */
+
+	/* Queue I2C transaction request and wait for completion */
+	prvI2C_Transaction(pxI2C);
+
+	/* I2C transaction complete, return status */
+	return pxI2C->status;
+
+} /*end ucI2C_Scan */
+
+/*******************
+ * ucI2C_Execute() *
+ *******************
+ * Perform a prepared (const, flash resident) access
+ * - the opcode, address and command byte come from pxPrepared; only the
+ *   write data (data, ignored by reads) is written into the request
+ * - read data is returned in pxI2C->data[] as for the ucI2C_* wrappers
+ */
+unsigned portCHAR ucI2C_Execute (xI2C_struct *pxI2C,
+								 const xI2C_Prepared *pxPrepared,
+								 unsigned portBASE_TYPE data)
+{
+	/* Initialize parameters for request */
+	pxI2C->pxPrepared = pxPrepared;		/* Prepared access */
+										/* Write data, byte 0 and 1 */
+	pxI2C->data[0]	= (unsigned portCHAR) (data & 0x00FF);
+	pxI2C->data[1]	= (unsigned portCHAR)((data & 0xFF00) >> 8);
+
+	/* Queue I2C transaction request and wait for completion */
+	prvI2C_Transaction(pxI2C);
+
+	/* The request is back from the engine; later ucI2C_* calls use the
+	 * request's own opcode, addr and comm again.
+	 */
+	pxI2C->pxPrepared = NULL;
+
+	/* I2C transaction complete, return status */
+	return pxI2C->status;
+
+} /*end ucI2C_Execute */
+
+
+/*****************
+ * pxI2C_Alloc() *
+ *****************
+ * Take a request descriptor from the pool
+ * - reqID and pxHandle (the xI2C_Signal) identify the owning task
+ * - returns NULL if every pool descriptor is in use
+ */
+xI2C_struct *pxI2C_Alloc (unsigned portCHAR reqID, void *pxHandle)
+{
+	xI2C_struct *pxI2C;
+
+	portENTER_CRITICAL();
+
+	pxI2C = pxI2C_Free;
+	if (pxI2C != NULL) {
+		pxI2C_Free = pxI2C->pxNext;
+	}
+
+	portEXIT_CRITICAL();
+
+	if (pxI2C != NULL) {
+		pxI2C->reqID	= reqID;
+		pxI2C->pxHandle	= pxHandle;
+		pxI2C->flags	= I2C_FLAG_POOL;
+		pxI2C->status	= I2C_ERROR;
+		pxI2C->pxComplete = NULL;
+		pxI2C->pxPrepared = NULL;
+	}
+
+	return pxI2C;
+
+} /*end pxI2C_Alloc */
+
+/******************
+ * vI2C_Release() *
+ ******************
+ * Return a request descriptor to the pool
+ * - called by the owning task once it is done with a completed request,
+ *   or by the I2C engine for I2C_FLAG_RELEASE requests
+ * - descriptors that do not belong to the pool are ignored
+ */
+void vI2C_Release (xI2C_struct *pxI2C)
+{
+	if ((pxI2C == NULL) || !(pxI2C->flags & I2C_FLAG_POOL)) {
+		return;
+	}
+
+	portENTER_CRITICAL();
+
+	pxI2C->pxNext = pxI2C_Free;
+	pxI2C_Free = pxI2C;
+
+	portEXIT_CRITICAL();
+
+} /*end vI2C_Release */
+
+/******************
+ * ucI2C_Submit() *
+ ******************
+ * Queue a filled-in request descriptor without waiting for completion
+ * - returns pdTRUE once the request is queued
+ * - returns pdFALSE with status I2C_QUEUE_FULL if the request queue is full
+ * - the descriptor must not be submitted again until it is done
+ */
+unsigned portCHAR ucI2C_Submit (xI2C_struct *pxI2C)
+{
+	return ucI2C_SubmitWait(pxI2C, (portTickType) 0);
+
+} /*end ucI2C_Submit */
+
+/**********************
+ * ucI2C_SubmitWait() *
+ **********************
+ * Queue a filled-in request descriptor, waiting up to xTicksToWait for
+ * room in the request queue, without waiting for completion
+ * - returns pdTRUE once the request is queued
+ * - returns pdFALSE with status I2C_QUEUE_FULL (and done set) if the queue
+ *   stayed full; nothing was queued
+ */
+unsigned portCHAR ucI2C_SubmitWait (xI2C_struct *pxI2C, portTickType xTicksToWait)
+{
+	if (prvI2C_Reserve(xTicksToWait) == pdFALSE) {
+		pxI2C->status	= I2C_QUEUE_FULL;
+		pxI2C->done		= pdTRUE;
+		return pdFALSE;
+	}
+
+	/* Default status is error, transaction execution will modify it */
+	pxI2C->status	= I2C_ERROR;
+	pxI2C->done		= pdFALSE;
+	pxI2C->cancel	= pdFALSE;
+	pxI2C->flags	&= ~I2C_FLAG_ENGINE;
+	pxI2C->ucPriority = (unsigned portCHAR) uxTaskPriorityGet(NULL);
+	pxI2C->ulQueued	= READ(T3TC);
+
+	/* Queue the request and ring the engine's doorbell */
+	prvI2C_Enqueue(pxI2C);
+
+#if I2C_INHERIT == 1
+	/* Lend the engine this task's priority (AFTER the request is queued,
+	 * so the engine cannot drop it again without having seen the request)
+	 */
+	vTaskSuspendAll();
+
+	if ((xI2CTask != NULL) &&
+		(uxTaskPriorityGet(xI2CTask) < pxI2C->ucPriority)) {
+		vTaskPrioritySet(xI2CTask, pxI2C->ucPriority);
+		ulI2C_Boosts++;
+	}
+
+	xTaskResumeAll();
+#endif
+
+	return pdTRUE;
+
+} /*end ucI2C_SubmitWait */
+
+/********************
+ * ucI2C_Continue() *
+ ********************
+ * Queue a follow-up request from a completion handler (engine context
+ * only)
+ * - typically the handler refills the request it was given with the next
+ *   step of a protocol, continues it and returns pdTRUE
+ * - prvI2C_Drain moves the request to the front of the ready list, so it
+ *   is started right after the transaction that just completed; it does
+ *   not wait for (or use) a request queue slot
+ * - a request cancelled by its requester stays cancelled
+ */
+unsigned portCHAR ucI2C_Continue (xI2C_struct *pxI2C)
+{
+	pxI2C->status	= I2C_ERROR;
+	pxI2C->done		= pdFALSE;
+	pxI2C->flags	|= I2C_FLAG_ENGINE;
+	pxI2C->pxNext	= NULL;
+
+	if (pxI2C_Continued == NULL) {
+		pxI2C_Continued = pxI2C;
+	}
+	else {
+		pxI2C_ContinuedTail->pxNext = pxI2C;
+	}
+	pxI2C_ContinuedTail = pxI2C;
+
+	/* Make sure a dispatch pass follows (the handler may be running from
+	 * the ready list scan itself)
+	 */
+	WRITE(VICSoftInt, i2cVIC_I2C0);
+
+	return pdTRUE;
+
+} /*end ucI2C_Continue */
+
+/*************************
+ * ucI2C_SubmitFromISR() *
+ *************************
+ * Queue a filled-in request descriptor from an interrupt service routine
+ * - like ucI2C_Continue() it does not use a request queue slot (an ISR
+ *   cannot wait for one), so the owner must keep at most one such request
+ *   outstanding
+ * - the request is queued with the ucPriority its owner filled in; no
+ *   task priority is looked up or lent to the engine from here
+ * - returns pdTRUE; completion is reported as for ucI2C_Submit(), usually
+ *   through a completion handler
+ */
+unsigned portCHAR ucI2C_SubmitFromISR (xI2C_struct *pxI2C)
+{
+	pxI2C->status	= I2C_ERROR;
+	pxI2C->done		= pdFALSE;
+	pxI2C->cancel	= pdFALSE;
+	pxI2C->flags	|= I2C_FLAG_ENGINE;
+	pxI2C->ulQueued	= READ(T3TC);
+
+	/* Queue the request and ring the engine's doorbell (the queue is
+	 * lock-free, see prvI2C_Enqueue)
+	 */
+	prvI2C_Enqueue(pxI2C);
+
+	return pdTRUE;
+
+} /*end ucI2C_SubmitFromISR */
+
+/********************
+ * prvI2C_Reserve() *
+ ********************
+ * Take a request queue slot, waiting up to xTicksToWait for one to free up
+ * - returns pdFALSE (and counts a full event) on timeout
+ *
+ * Same scheme as ucI2C_Wait(): the depth test and blocking are made atomic
+ * against prvI2C_Unreserve() by suspending the scheduler.
+ */
+static unsigned portCHAR prvI2C_Reserve( portTickType xTicksToWait )
+{
+	xTimeOutType xTimeOut;
+
+	vTaskSetTimeOutState(&xTimeOut);
+
+	for(;;){
+
+		vTaskSuspendAll();
+
+		if (xI2C_Queue.uxDepth < I2C_QUEUE_DEPTH) {
+			xI2C_Queue.uxDepth++;
+			if (xI2C_Queue.uxDepth > xI2C_Queue.uxPeak) {
+				xI2C_Queue.uxPeak = xI2C_Queue.uxDepth;
+			}
+			xTaskResumeAll();
+			return pdTRUE;
+		}
+
+		if ((xTicksToWait == 0) ||
+			(xTaskCheckForTimeOut(&xTimeOut, &xTicksToWait) == pdTRUE)) {
+			xI2C_Queue.ulFull++;
+			xTaskResumeAll();
+			return pdFALSE;
+		}
+
+		xI2C_Queue.ulWaits++;
+		vTaskPlaceOnEventList(&(xI2C_SlotSignal.xWaiters), xTicksToWait);
+
+		if (xTaskResumeAll() == pdFALSE) {
+			taskYIELD();
+		}
+	}
+
+} /*end prvI2C_Reserve */
+
+/**********************
+ * prvI2C_Unreserve() *
+ **********************
+ * Free the queue slot of a request leaving the ready list and wake one
+ * task waiting for a slot (called by the engine)
+ * - requests continued from engine context never hold a slot
+ */
+static void prvI2C_Unreserve( xI2C_struct *pxI2C )
+{
+	if (pxI2C->flags & I2C_FLAG_ENGINE) {
+		return;
+	}
+
+	vTaskSuspendAll();
+
+	xI2C_Queue.uxDepth--;
+
+	if (listLIST_IS_EMPTY(&(xI2C_SlotSignal.xWaiters)) == pdFALSE) {
+		xTaskRemoveFromEventList(&(xI2C_SlotSignal.xWaiters));
+	}
+
+	xTaskResumeAll();
+
+} /*end prvI2C_Unreserve */
+
+/******************
+ * ucI2C_Cancel() *
+ ******************
+ * Take back a submitted request
+ * - a queued request is returned with I2C_CANCELLED without using the bus
+ * - a request in flight is aborted at the next byte boundary with a STOP
+ *   and returned with I2C_CANCELLED
+ * - returns pdTRUE if the request was cancelled, pdFALSE if it completed
+ *   (normally or with an error) first
+ *
+ * Waits until the engine has returned the request, which is bounded by the
+ * bus watchdog, so the descriptor may be reused or released as soon as this
+ * returns. Not for I2C_FLAG_RELEASE requests (the engine owns those).
+ */
+unsigned portCHAR ucI2C_Cancel (xI2C_struct *pxI2C)
+{
+	pxI2C->cancel = pdTRUE;
+
+	/* Ring the doorbell so the engine looks at the request now */
+	WRITE(VICSoftInt, i2cVIC_I2C0);
+
+	ucI2C_Wait(pxI2C, portMAX_DELAY);
+
+	return (unsigned portCHAR) (pxI2C->status == I2C_CANCELLED);
+
+} /*end ucI2C_Cancel */
+
+/********************
+ * prvI2C_Enqueue() *
+ ********************
+ * Append a request to the I2C request queue and notify the engine
+ *
+ * Any number of tasks may call this concurrently (and may be preempted at
+ * any point):
+ *
+ * 1) the swap atomically makes pxI2C the new head and returns the previous
+ *    head, so each producer owns a distinct link to fill in
+ * 2) linking the previous head to pxI2C publishes the request to the engine
+ * 3) the doorbell (software interrupt on VIC channel 9) is rung last, so the
+ *    engine always runs a dispatch pass after the request is reachable
+ */
+static void prvI2C_Enqueue( xI2C_struct *pxI2C )
+{
+	xI2C_struct *pxPrev;
+
+	pxI2C->pxNext = NULL;
+	pxPrev = (xI2C_struct *) pvI2C_Swap((void * volatile *) &pxI2C_Head, (void *) pxI2C);
+	pxPrev->pxNext = pxI2C;
+
+	WRITE(VICSoftInt, i2cVIC_I2C0);
+
+} /*end prvI2C_Enqueue */
+
+/********************
+ * prvI2C_Dequeue() *
+ ********************
+ * Remove the oldest request from the I2C request queue (vI2CTask only)
+ * - returns NULL if the queue is empty, or if the oldest request is still
+ *   being linked in by a preempted producer (its doorbell follows)
+ */
+static xI2C_struct *prvI2C_Dequeue( void )
+{
+	xI2C_struct *pxTail = pxI2C_Tail;
+	xI2C_struct *pxNext = pxTail->pxNext;
+	xI2C_struct *pxPrev;
+
+	/* Step over the placeholder node */
+	if (pxTail == &xI2C_Stub) {
+		if (pxNext == NULL) {
+			return NULL;
+		}
+		pxI2C_Tail = pxNext;
+		pxTail = pxNext;
+		pxNext = pxNext->pxNext;
+	}
+
+	/* More than one request queued, the oldest can be taken */
+	if (pxNext != NULL) {
+		pxI2C_Tail = pxNext;
+		return pxTail;
+	}
+
+	/* A producer has swapped the head but not yet linked it */
+	if (pxTail != pxI2C_Head) {
+		return NULL;
+	}
+
+	/* pxTail is the only request. Re-insert the placeholder behind it so
+	 * that pxTail can be unlinked without touching pxI2C_Head.
+	 */
+	xI2C_Stub.pxNext = NULL;
+	pxPrev = (xI2C_struct *) pvI2C_Swap((void * volatile *) &pxI2C_Head, (void *) &xI2C_Stub);
+	pxPrev->pxNext = &xI2C_Stub;
+
+	pxNext = pxTail->pxNext;
+	if (pxNext != NULL) {
+		pxI2C_Tail = pxNext;
+		return pxTail;
+	}
+
+	return NULL;
+
+} /*end prvI2C_Dequeue */
+
+/******************
+ * prvI2C_Drain() *
+ ******************
+ * Move every queued request onto the ready list and return the ones that
+ * have been cancelled (vI2CTask only, on every pass)
+ * - continued requests go to the front, queued requests to the back
+ * - a dequeued request's pxNext is no longer used by the queue and can
+ *   link the ready list
+ */
+static void prvI2C_Drain( void )
+{
+	xI2C_struct *pxI2C;
+	xI2C_struct *pxPrev;
+	xI2C_struct *pxCancelled;
+
+	if (pxI2C_Continued != NULL) {
+		pxI2C_ContinuedTail->pxNext = pxI2C_Ready;
+		if (pxI2C_Ready == NULL) {
+			pxI2C_ReadyTail = pxI2C_ContinuedTail;
+		}
+		pxI2C_Ready = pxI2C_Continued;
+		pxI2C_Continued = NULL;
+	}
+
+	while ((pxI2C = prvI2C_Dequeue()) != NULL) {
+		ulI2C_PickupLast = READ(T3TC) - pxI2C->ulQueued;
+		if (ulI2C_PickupLast > ulI2C_PickupMax) {
+			ulI2C_PickupMax = ulI2C_PickupLast;
+		}
+		pxI2C->pxNext = NULL;
+		if (pxI2C_Ready == NULL) {
+			pxI2C_Ready = pxI2C;
+		}
+		else {
+			pxI2C_ReadyTail->pxNext = pxI2C;
+		}
+		pxI2C_ReadyTail = pxI2C;
+	}
+
+	pxPrev = NULL;
+	pxI2C = pxI2C_Ready;
+
+	while (pxI2C != NULL) {
+
+		if (pxI2C->cancel == pdTRUE) {
+
+			pxCancelled = pxI2C;
+
+			pxI2C = pxI2C->pxNext;
+			if (pxPrev == NULL) {
+				pxI2C_Ready = pxI2C;
+			}
+			else {
+				pxPrev->pxNext = pxI2C;
+			}
+			if (pxI2C_ReadyTail == pxCancelled) {
+				pxI2C_ReadyTail = pxPrev;
+			}
+
+			prvI2C_Unreserve(pxCancelled);
+			prvI2C_Complete(pxCancelled, I2C_CANCELLED);
+			continue;
+		}
+
+		pxPrev = pxI2C;
+		pxI2C = pxI2C->pxNext;
+
+	} /* end while (pxI2C != NULL) */
+
+} /*end prvI2C_Drain */
+
+/********************
+ * prvI2C_Inherit() *
+ ********************
+ * Set the engine priority to the highest priority of the requesters with
+ * a request in flight (pxActive) or on the ready list, and never below
+ * the priority the engine was started with (vI2CTask only)
+ *
+ * Called with the scheduler suspended together with prvI2C_Drain():
+ * a requesting task raises the engine priority only after queuing its
+ * request, so the engine either sees that request here or is raised
+ * again after lowering itself.
+ *
+ * With I2C_INHERIT = 0 the engine keeps its start priority.
+ */
+static void prvI2C_Inherit( xI2C_struct *pxActive )
+{
+#if I2C_INHERIT == 1
+	unsigned portBASE_TYPE uxPriority = uxI2C_BasePriority;
+	xI2C_struct *pxI2C;
+
+	if ((pxActive != NULL) && (pxActive->ucPriority > uxPriority)) {
+		uxPriority = pxActive->ucPriority;
+	}
+
+	for (pxI2C = pxI2C_Ready; pxI2C != NULL; pxI2C = pxI2C->pxNext) {
+		if (pxI2C->ucPriority > uxPriority) {
+			uxPriority = pxI2C->ucPriority;
+		}
+	}
+
+	if (uxTaskPriorityGet(NULL) != uxPriority) {
+		vTaskPrioritySet(NULL, uxPriority);
+	}
+#else
+	(void) pxActive;
+#endif
+
+} /*end prvI2C_Inherit */
+
+/*******************
+ * prvI2C_Select() *
+ *******************
+ * Choose the next request to start from the ready list (vI2CTask only,
+ * after prvI2C_Drain)
+ *
+ * 1) fail every request whose deadline has passed with I2C_EXPIRED,
+ *    without using the bus
+ * 2) remove and return the request with the earliest deadline; requests
+ *    without a deadline (I2C_FLAG_DEADLINE clear) are taken in arrival
+ *    order once no request with a deadline is ready
+ *
+ * Requests from a requester that has used up its bandwidth budget stay on
+ * the ready list until the next budget period (deadlines still apply).
+ *
+ * - returns NULL if nothing is ready
+ * - deadlines are compared as signed tick differences so that tick count
+ *   wrap-around is harmless
+ */
+static xI2C_struct *prvI2C_Select( void )
+{
+	xI2C_struct *pxI2C;
+	xI2C_struct *pxPrev;
+	xI2C_struct *pxBest;
+	xI2C_struct *pxBestPrev;
+	portTickType xNow;
+	unsigned portBASE_TYPE uxIndex;
+
+	xNow = xTaskGetTickCount();
+	prvI2C_Replenish(xNow);
+	xI2C_Block = portMAX_DELAY;
+	pxBest = NULL;
+	pxBestPrev = NULL;
+	pxPrev = NULL;
+	pxI2C = pxI2C_Ready;
+
+	while (pxI2C != NULL) {
+
+		/* Deadline already reached: unlink it and fail it */
+		if ((pxI2C->flags & I2C_FLAG_DEADLINE) &&
+			((portLONG) (xNow - pxI2C->xDeadline) >= 0)) {
+
+			xI2C_struct *pxExpired = pxI2C;
+
+			pxI2C = pxI2C->pxNext;
+			if (pxPrev == NULL) {
+				pxI2C_Ready = pxI2C;
+			}
+			else {
+				pxPrev->pxNext = pxI2C;
+			}
+			if (pxI2C_ReadyTail == pxExpired) {
+				pxI2C_ReadyTail = pxPrev;
+			}
+
+			ulI2C_DeadlineMisses++;
+			prvI2C_Unreserve(pxExpired);
+			prvI2C_Complete(pxExpired, I2C_EXPIRED);
+			continue;
+		}
+
+		/* Hold the request back if its requester has used up its bus
+		 * bandwidth budget for this period
+		 */
+		for (uxIndex = 0; uxIndex < I2C_BUDGETS; uxIndex++) {
+			if ((xI2C_Budgets[uxIndex].ulReserved != 0) &&
+				(xI2C_Budgets[uxIndex].reqID == pxI2C->reqID)) {
+				break;
+			}
+		}
+
+		if ((uxIndex < I2C_BUDGETS) && (xI2C_Budgets[uxIndex].lTokens <= 0)) {
+			xI2C_Budgets[uxIndex].ulDeferred++;
+			xI2C_Block = (xI2C_Period + I2C_BUDGET_PERIOD) - xNow;
+		}
+
+		/* Keep the earliest deadline, or the oldest request if none of
+		 * the requests seen so far has a deadline.
+		 */
+		else if ((pxBest == NULL) ||
+			((pxI2C->flags & I2C_FLAG_DEADLINE) &&
+			 (!(pxBest->flags & I2C_FLAG_DEADLINE) ||
+			  ((portLONG) (pxI2C->xDeadline - pxBest->xDeadline) < 0)))) {
+			pxBest = pxI2C;
+			pxBestPrev = pxPrev;
+		}
+
+		pxPrev = pxI2C;
+		pxI2C = pxI2C->pxNext;
+
+	} /* end while (pxI2C != NULL) */
+
+	/* Unlink the chosen request */
+	if (pxBest != NULL) {
+		if (pxBestPrev == NULL) {
+			pxI2C_Ready = pxBest->pxNext;
+		}
+		else {
+			pxBestPrev->pxNext = pxBest->pxNext;
+		}
+		if (pxI2C_ReadyTail == pxBest) {
+			pxI2C_ReadyTail = pxBestPrev;
+		}
+		prvI2C_Unreserve(pxBest);
+	}
+
+	return pxBest;
+
+} /*end prvI2C_Select */
+
+/**********************
+ * prvI2C_Replenish() *
+ **********************
+ * Start a new budget period once I2C_BUDGET_PERIOD ticks have passed
+ * - each requester gets its reservation back; an overrun (negative
+ *   balance) is paid back from it, unused time is not carried over
+ */
+static void prvI2C_Replenish( portTickType xNow )
+{
+	unsigned portBASE_TYPE uxIndex;
+	portLONG lReserved;
+
+	if ((xNow - xI2C_Period) < I2C_BUDGET_PERIOD) {
+		return;
+	}
+
+	xI2C_Period = xNow;
+
+	for (uxIndex = 0; uxIndex < I2C_BUDGETS; uxIndex++) {
+		lReserved = (portLONG) xI2C_Budgets[uxIndex].ulReserved;
+		if (xI2C_Budgets[uxIndex].lTokens > 0) {
+			xI2C_Budgets[uxIndex].lTokens = 0;
+		}
+		xI2C_Budgets[uxIndex].lTokens += lReserved;
+		xI2C_Budgets[uxIndex].ulLastUsed = xI2C_Budgets[uxIndex].ulUsed;
+		xI2C_Budgets[uxIndex].ulUsed = 0;
+	}
+
+} /*end prvI2C_Replenish */
+
+/*********************
+ * ucI2C_SetBudget() *
+ *********************
+ * Reserve ulMicroseconds of bus time per I2C_BUDGET_PERIOD ticks for the
+ * requester reqID (ulMicroseconds = 0 removes the reservation)
+ * - the new reservation takes effect immediately, for the current period
+ * - returns pdFALSE if all I2C_BUDGETS entries are in use
+ */
+unsigned portCHAR ucI2C_SetBudget( unsigned portCHAR reqID, unsigned portLONG ulMicroseconds )
+{
+	unsigned portBASE_TYPE uxIndex;
+	unsigned portBASE_TYPE uxFree = I2C_BUDGETS;
+	unsigned portLONG ulCycles;
+
+	/* No more than the whole period can be reserved */
+	if (ulMicroseconds > ((I2C_BUDGET_PERIOD * 1000000) / configTICK_RATE_HZ)) {
+		ulMicroseconds = (I2C_BUDGET_PERIOD * 1000000) / configTICK_RATE_HZ;
+	}
+
+	/* Same conversion as vI2C_SetTimeout: Pclk cycles per 100 us */
+	ulCycles = (ulMicroseconds * (configCPU_CLOCK_HZ / 10000)) / 100;
+
+	portENTER_CRITICAL();
+
+	for (uxIndex = 0; uxIndex < I2C_BUDGETS; uxIndex++) {
+		if (xI2C_Budgets[uxIndex].ulReserved == 0) {
+			if (uxFree == I2C_BUDGETS) {
+				uxFree = uxIndex;
+			}
+		}
+		else if (xI2C_Budgets[uxIndex].reqID == reqID) {
+			break;
+		}
+	}
+
+	if ((uxIndex == I2C_BUDGETS) && (ulCycles != 0)) {
+		uxIndex = uxFree;
+		if (uxIndex < I2C_BUDGETS) {
+			xI2C_Budgets[uxIndex].reqID = reqID;
+			xI2C_Budgets[uxIndex].ulUsed = 0;
+			xI2C_Budgets[uxIndex].ulLastUsed = 0;
+			xI2C_Budgets[uxIndex].ulDeferred = 0;
+		}
+	}
+
+	if (uxIndex < I2C_BUDGETS) {
+		xI2C_Budgets[uxIndex].ulReserved = ulCycles;
+		xI2C_Budgets[uxIndex].lTokens = (portLONG) ulCycles -
+										(portLONG) xI2C_Budgets[uxIndex].ulUsed;
+	}
+
+	portEXIT_CRITICAL();
+
+	/* Let the engine re-evaluate anything it is holding back */
+	WRITE(VICSoftInt, i2cVIC_I2C0);
+
+	return (unsigned portCHAR) ((uxIndex < I2C_BUDGETS) || (ulCycles == 0));
+
+} /*end ucI2C_SetBudget */
+
+/*********************
+ * ucI2C_GetBudget() *
+ *********************
+ * Report the reserved versus consumed bus time of the requester reqID
+ * - returns pdFALSE if reqID has no reservation
+ */
+unsigned portCHAR ucI2C_GetBudget( unsigned portCHAR reqID, xI2C_BudgetReport *pxReport )
+{
+	unsigned portBASE_TYPE uxIndex;
+	unsigned portLONG ulCyclesPer100us = configCPU_CLOCK_HZ / 10000;
+
+	portENTER_CRITICAL();
+
+	for (uxIndex = 0; uxIndex < I2C_BUDGETS; uxIndex++) {
+		if ((xI2C_Budgets[uxIndex].ulReserved != 0) &&
+			(xI2C_Budgets[uxIndex].reqID == reqID)) {
+			pxReport->reqID = reqID;
+			pxReport->ulReserved = (xI2C_Budgets[uxIndex].ulReserved * 100) / ulCyclesPer100us;
+			pxReport->ulConsumed = (xI2C_Budgets[uxIndex].ulUsed * 100) / ulCyclesPer100us;
+			pxReport->ulLastConsumed = (xI2C_Budgets[uxIndex].ulLastUsed * 100) / ulCyclesPer100us;
+			pxReport->ulDeferred = xI2C_Budgets[uxIndex].ulDeferred;
+			break;
+		}
+	}
+
+	portEXIT_CRITICAL();
+
+	return (unsigned portCHAR) (uxIndex < I2C_BUDGETS);
+
+} /*end ucI2C_GetBudget */
+
+/*********************
+ * vI2C_SignalInit() *
+ *********************
+ * Initialize a task's completion signal (replaces a completion queue)
+ */
+void vI2C_SignalInit (xI2C_Signal *pxSignal)
+{
+	vListInitialise(&(pxSignal->xWaiters));
+
+} /*end vI2C_SignalInit */
+
+/*****************
+ * prvI2C_Signal *
+ *****************
+ * Complete a request: set its done flag and wake the task blocked on its
+ * completion signal (called by the engine).
+ *
+ * Requesting tasks and the engine are all tasks, so suspending the
+ * scheduler is enough to make "set flag + wake" atomic with respect to
+ * "test flag + block" in ucI2C_Wait(). Interrupts stay enabled.
+ */
+static void prvI2C_Signal( xI2C_struct *pxI2C )
+{
+	xI2C_Signal *pxSignal = (xI2C_Signal *) pxI2C->pxHandle;
+
+	vTaskSuspendAll();
+
+	pxI2C->done = pdTRUE;
+
+	if ((pxSignal != NULL) &&
+		(listLIST_IS_EMPTY(&(pxSignal->xWaiters)) == pdFALSE)) {
+		xTaskRemoveFromEventList(&(pxSignal->xWaiters));
+	}
+
+	/* Resuming the scheduler yields if the woken task has priority */
+	xTaskResumeAll();
+
+} /*end prvI2C_Signal */
+
+/****************
+ * ucI2C_Wait() *
+ ****************
+ * Wait up to xTicksToWait for a request to complete
+ * - returns pdTRUE if the request is done, pdFALSE on timeout
+ */
+unsigned portCHAR ucI2C_Wait (xI2C_struct *pxI2C, portTickType xTicksToWait)
+{
+	xI2C_Signal *pxSignal = (xI2C_Signal *) pxI2C->pxHandle;
+	xTimeOutType xTimeOut;
+
+	vTaskSetTimeOutState(&xTimeOut);
+
+	for(;;){
+
+		vTaskSuspendAll();
+
+		if (pxI2C->done == pdTRUE) {
+			xTaskResumeAll();
+			return pdTRUE;
+		}
+
+		if ((xTicksToWait == 0) ||
+			(xTaskCheckForTimeOut(&xTimeOut, &xTicksToWait) == pdTRUE)) {
+			xTaskResumeAll();
+			return pdFALSE;
+		}
+
+		/* Block on the completion signal until prvI2C_Signal() wakes this
+		 * task or the remaining time expires, then test the flag again.
+		 */
+		vTaskPlaceOnEventList(&(pxSignal->xWaiters), xTicksToWait);
+
+		if (xTaskResumeAll() == pdFALSE) {
+			taskYIELD();
+		}
+	}
+
+} /*end ucI2C_Wait */
+
+#if I2C_MEASURE == 1
+/*****************************
+ * vI2C_MeasureCompletion() *
+ *****************************
+ * Measure the cost of one completion through the real kernel paths, once
+ * with a FreeRTOS queue (the way completions used to be signalled) and once
+ * with xI2C_Signal, and store the result in xI2C_Cost.
+ *
+ * - first both halves are timed with no task blocked, which compares the
+ *   primitives themselves
+ * - then a helper task one priority above the caller blocks in
+ *   xQueueReceive() and then in ucI2C_Wait(), and the time from the
+ *   signal to the helper running is taken for each: the event list
+ *   removal, the yield and the context switch of a real completion
+ * - must be called from a task below configMAX_PRIORITIES - 1 (the
+ *   scheduler must be running); the helper deletes itself, its stack goes
+ *   back to the heap
+ */
+void vI2C_MeasureCompletion (void)
+{
+	xQueueHandle xQueue;
+	xI2C_Signal xSignal;
+	xI2C_struct xI2C;
+	unsigned portLONG ulStart;
+
+	/* Queue: xQueueCreate(1, 0) exactly as a completion queue was created */
+	xQueue = xQueueCreate( (unsigned portBASE_TYPE) 1, (unsigned portBASE_TYPE) 0 );
+
+	if (xQueue != NULL) {
+		ulStart = ulCYCLES_NOW();
+		xQueueSendToBack(xQueue, (void *) NULL, (portTickType) 0);
+		xI2C_Cost.ulQueueSignal = ulCyclesSince(ulStart);
+
+		ulStart = ulCYCLES_NOW();
+		xQueueReceive(xQueue, (void *) NULL, (portTickType) 0);
+		xI2C_Cost.ulQueueWait = ulCyclesSince(ulStart);
+
+		vQueueDelete(xQueue);
+	}
+
+	/* Flag + direct wake */
+	vI2C_SignalInit(&xSignal);
+	xI2C.pxHandle = (void *) &xSignal;
+	xI2C.done = pdFALSE;
+
+	ulStart = ulCYCLES_NOW();
+	prvI2C_Signal(&xI2C);
+	xI2C_Cost.ulFlagSignal = ulCyclesSince(ulStart);
+
+	ulStart = ulCYCLES_NOW();
+	ucI2C_Wait(&xI2C, (portTickType) 0);
+	xI2C_Cost.ulFlagWait = ulCyclesSince(ulStart);
+
+	xI2C_Cost.ulFlagRAM = sizeof(xI2C_Signal);
+
+	/* Signal to wake, with the helper blocked */
+	xI2C_MeasureQueue = xQueueCreate( (unsigned portBASE_TYPE) 1, (unsigned portBASE_TYPE) 0 );
+	pxI2C_Measure = &xI2C;
+	xI2C.done = pdFALSE;
+
+	if ((xI2C_MeasureQueue != NULL) &&
+		(xTaskCreate(prvI2C_MeasureTask, (const signed portCHAR *) "I2CM",
+					 configMINIMAL_STACK_SIZE, (void *) NULL,
+					 uxTaskPriorityGet(NULL) + 1, (xTaskHandle *) NULL) == pdPASS)) {
+
+		/* The helper has run and is blocked in xQueueReceive() */
+		ulStart = ulCYCLES_NOW();
+		xQueueSendToBack(xI2C_MeasureQueue, (void *) NULL, (portTickType) 0);
+		xI2C_Cost.ulQueueWake = ulCYCLES_ELAPSED(ulStart, ulI2C_Woken);
+
+		/* Now it is blocked in ucI2C_Wait() */
+		ulStart = ulCYCLES_NOW();
+		prvI2C_Signal(&xI2C);
+		xI2C_Cost.ulFlagWake = ulCYCLES_ELAPSED(ulStart, ulI2C_Woken);
+	}
+
+	if (xI2C_MeasureQueue != NULL) {
+		vQueueDelete(xI2C_MeasureQueue);
+		xI2C_MeasureQueue = NULL;
+	}
+
+} /*end vI2C_MeasureCompletion */
+
+/**********************
+ * prvI2C_MeasureTask *
+ **********************
+ * Helper of vI2C_MeasureCompletion: block on each completion primitive in
+ * turn, stamp the time it runs again, then delete itself
+ */
+static void prvI2C_MeasureTask( void *pvParameters __attribute__ ((unused)) )
+{
+	if (xQueueReceive(xI2C_MeasureQueue, (void *) NULL, (portTickType) 100) == pdTRUE) {
+		ulI2C_Woken = ulCYCLES_NOW();
+	}
+
+	if (ucI2C_Wait(pxI2C_Measure, (portTickType) 100) == pdTRUE) {
+		ulI2C_Woken = ulCYCLES_NOW();
+	}
+
+	vTaskDelete(NULL);
+
+} /*end prvI2C_MeasureTask */
+#endif
+
+
 /************************
  * prvI2C_Transaction() *
  ***********************/
@@ -1029,73 +3029,60 @@ void prvI2C_Transaction (xI2C_struct *pxI2C) {
 
 	unsigned portCHAR q_status;
 
-	/* Set status to error code
-	 * - default status is error
-	 * - transaction execution will modify the status
+	/* Queue the request
+	 * - the status is preset to the error code, transaction execution will
+	 *   modify it
+	 * - if the request queue stays full for 35 ticks the status is
+	 *   I2C_QUEUE_FULL and nothing is queued
+	 *
+	 * NOTE: The engine (vI2CTask) starts the request as soon as the bus is
+	 *       free. If an I2C transaction is already in progress then the new
+	 *       request simply waits in the request queue; the engine begins
+	 *       servicing it when the current transaction completes.
+	 */
+	if (ucI2C_SubmitWait(pxI2C, (portTickType) 35) != pdTRUE) {
+		return;
+	}
+
+	/* Wait for the I2C transaction to be completed...
+	 *
+	 * HACK HACK HACK - look into MAX limits
+	 */
+	q_status = (portCHAR) ucI2C_Wait( pxI2C, (portTickType) 35);
+
+	/* Gave up waiting: take the request back from the engine so that it
+	 * can never complete into the descriptor after it has been reused.
+	 */
+	if (q_status != (portCHAR) pdTRUE) {
+		ucI2C_Cancel(pxI2C);
+	}
+
+	/* Check the response status */
+	if( (q_status != (portCHAR) pdTRUE) || (pxI2C->status != 0) ) {
+
+		/* I2C ERROR during the transaction...
+		 *
+		 * The I2CISR attempts to return the I2C controller to an operational
+		 * state. However, the transaction that encountered the error is NOT
+		 * recovered.
+		 *
+		 * Wait for the I2C bus to timeout (i.e. slave devices).
+		 *
+		 * HACK HACK HACK - The timeout value was chosen based on SMBus
+		 * requirements. This is NOT a guarantee that the bus will return
+		 * to an operational state. It may also be possible that a shorter
+		 * timeout would be okay.
+		 */
+		vTaskDelay(35);
+
+	} /* end if( (q_status != (portCHAR) pdTRUE) || (pxI2C->status != 0) ) */
+
+	/* Transaction is done
+	 *
+	 * Status is in pxI2C structure
+	 * - if succesfull pxI2C->status == 0
+	 * - if NOT successful pxI2C->status != 0
 	 */
-	pxI2C->status	= 0xFF;
-
-	/* Queue the request */
-	q_status = (portCHAR) xQueueSend ( pxI2C_RQ, (void *) &pxI2C, (portTickType) 0);
-
-    if (q_status == pdTRUE) {
-      /* Request successfully queued
-  	   *
-  	   * Check/modify the ucI2C_busy flag in a critical section
-       * - If NOT busy
-       * 	- kick start the I2C controller
-       *    - set the ucI2C_busy flag
-       *
-       * NOTE: If an I2C transaction is already in progress then the
-       *       new I2C transaction is simply put on the request queue.
-       *       The I2CISR will complete the current I2C transaction and
-       *       automatically begin servicing the next I2C request in the
-       *       queue.
-       */
-      portENTER_CRITICAL();
-
-      if (ucI2C_busy == pdFALSE) {
-        /* Not busy... */
-        WRITE(I2C0CONSET, 0x20);
-         ucI2C_busy = pdTRUE;
-      }
-
-      portEXIT_CRITICAL();
-
-      /* Wait for the I2C transaction to be completed...
-       *
-       * HACK HACK HACK - look into MAX limits
-       */
-      q_status = (portCHAR) xQueueReceive( pxI2C->pxHandle, NULL, (portTickType) 35);
-
-      /* Check the response status */
-      if( (q_status != (portCHAR) pdTRUE) || (pxI2C->status != 0) ) {
-
-        /* I2C ERROR during the transaction...
-         *
-         * The I2CISR attempts to return the I2C controller to an operational
-         * state. However, the transaction that encountered the error is NOT
-         * recovered.
-         *
-         * Wait for the I2C bus to timeout (i.e. slave devices).
-         *
-         * HACK HACK HACK - The timeout value was chosen based on SMBus
-         * requirements. This is NOT a guarantee that the bus will return
-         * to an operational state. It may also be possible that a shorter
-         * timeout would be okay.
-         */
-        vTaskDelay(35);
-
-      } /* end if( (q_status != (portCHAR) pdTRUE) || (pxI2C->status != 0) ) */
-
-    } /* end if (q_status == pdTRUE) */
-
-    /* Transaction is done
-     *
-     * Status is in pxI2C structure
-     * - if succesfull pxI2C->status == 0
-     * - if NOT successful pxI2C->status != 0
-     */
-    return ;
+	return ;
 
 } /*end prvI2C_Transaction */
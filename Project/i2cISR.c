@@ -19,6 +19,13 @@ extern xSemaphoreHandle xI2CSemaphore;
 /* Function prototypes */
 void vI2C_ISR_Wrapper(void) __attribute__ ((naked));
 void vI2C_ISR(void);
+void *pvI2C_Swap( void * volatile *ppvAddr, void *pvNew );
+void vI2C_TimerISR(void) __attribute__ ((interrupt ("IRQ")));
+void vI2C_AlertISR(void) __attribute__ ((interrupt ("IRQ")));
+
+/* Declare external global variables (i2c.c) */
+extern volatile unsigned portCHAR ucI2C_Expired;
+extern volatile unsigned portCHAR ucI2C_AlertPending;
 
 /**********************
  * vI2C_ISR_Wrapper() *
@@ -68,7 +75,9 @@ void vI2C_ISR(void)
 	 */
 	if(READ(VICIRQStatus) & 0x00000200){
 
-		/* I2C0 interrupt is asserted.
+		/* I2C0 interrupt is asserted. This is either the I2C0 controller
+		 * (SI) or the submission "doorbell" (VICSoftInt) rung by a task that
+		 * queued a new request. The I2C handler task sorts out which.
 		 *
 		 * Give the semaphore to the I2C handler task.
 		 */
@@ -103,3 +112,82 @@ void vI2C_ISR(void)
 	WRITE(VICVectAddr, 0x0);
 
 } /* End I2C_ISR */
+
+
+/****************
+ * pvI2C_Swap() *
+ ****************
+ * Atomically store pvNew at *ppvAddr and return the previous value.
+ *
+ * Uses the ARM SWP instruction, which is only available in ARM state. This
+ * file is compiled in ARM mode (see Makefile), so the THUMB code in i2c.c
+ * calls this function rather than using inline assembly.
+ */
+void *pvI2C_Swap( void * volatile *ppvAddr, void *pvNew )
+{
+	void *pvOld;
+
+	asm volatile ( "SWP %0, %1, [%2]"
+				   : "=&r" (pvOld)
+				   : "r" (pvNew), "r" (ppvAddr)
+				   : "memory" );
+
+	return pvOld;
+
+} /* End pvI2C_Swap */
+
+
+/*******************
+ * vI2C_TimerISR() *
+ *******************/
+/* Timer3 match 0 - the I2C bus watchdog expired.
+ *
+ * This ISR makes no FreeRTOS calls and never switches context, so it does
+ * not need a wrapper. It disarms the (one-shot) watchdog, flags the expiry
+ * and rings the I2C doorbell so that the I2C handler task aborts the
+ * transaction and recovers the bus.
+ */
+void vI2C_TimerISR(void)
+{
+	/* Clear the Timer3 MR0 interrupt and stop further matches */
+	WRITE(T3IR, 0x01);
+	WRITE(T3MCR, 0x0000);
+
+	/* Flag the expiry and wake the I2C handler task (VIC channel 9) */
+	ucI2C_Expired = pdTRUE;
+	WRITE(VICSoftInt, 0x00000200);
+
+	/* Reset Vectored Interrupt Controller priority encoder (VICVectAddr) by
+	 * doing a dummy End-of-Interrupt write to VICVectAddr (required).
+	 */
+	WRITE(VICVectAddr, 0x0);
+
+} /* End vI2C_TimerISR */
+
+
+/*******************
+ * vI2C_AlertISR() *
+ *******************/
+/* EINT2 - a device asserted SMBALERT#.
+ *
+ * SMBALERT# stays asserted until the device has been read through the
+ * Alert Response Address, so the (level sensitive) EINT2 interrupt is
+ * masked here and re-enabled by the I2C handler task once the read is
+ * done. Like vI2C_TimerISR this ISR only flags the event and rings the
+ * I2C doorbell.
+ */
+void vI2C_AlertISR(void)
+{
+	/* Mask EINT2 (VIC channel 16) until the alert has been serviced */
+	WRITE(VICIntEnClear, 0x00010000);
+
+	/* Flag the alert and wake the I2C handler task (VIC channel 9) */
+	ucI2C_AlertPending = pdTRUE;
+	WRITE(VICSoftInt, 0x00000200);
+
+	/* Reset Vectored Interrupt Controller priority encoder (VICVectAddr) by
+	 * doing a dummy End-of-Interrupt write to VICVectAddr (required).
+	 */
+	WRITE(VICVectAddr, 0x0);
+
+} /* End vI2C_AlertISR */
@@ -0,0 +1,220 @@
+/***************
+ * i2cStress.c *
+ ***************/
+
+/* FreeRTOS includes */
+#include "FreeRTOS.h"
+#include "task.h"
+
+/* Project includes */
+#include "lpc2103.h"
+#include "i2c.h"
+#include "i2cStress.h"
+
+/* Project defines */
+#define stressSTACK_SIZE	((unsigned portSHORT) configMINIMAL_STACK_SIZE)
+#define stressREQID			0x10	/* reqID of task 0, then + 1 per task */
+#define stressISR			I2C_STRESS_TASKS	/* xSource[] of the ISR */
+
+/* One stress request
+ * - ucBusy is set by the submitter before it submits the request and
+ *   cleared once it has seen the completion (tick hook requests: by the
+ *   completion handler)
+ * - ucCompletions counts completion handler runs for this submission
+ */
+typedef struct xStressReq
+{
+	xI2C_struct xI2C;
+	volatile unsigned portCHAR ucBusy;
+	volatile unsigned portCHAR ucCompletions;
+} xStressReq;
+
+/* One submitter task and its requests */
+typedef struct xStressTask
+{
+	xI2C_Signal xSignal;
+	xStressReq xReq[I2C_STRESS_DEPTH];
+	xI2C_StressSource *pxSource;
+} xStressTask;
+
+/* Function prototypes */
+static void prvStress_Task( void *pvParameters );
+static void prvStress_Fill( xStressReq *pxReq, unsigned portCHAR reqID );
+static portBASE_TYPE prvStress_Done( xI2C_struct *pxI2C );
+void vApplicationTickHook( void );
+
+/* Stress report */
+xI2C_StressReport xI2C_Stress;
+
+/* Submitters */
+static xStressTask xStressTasks[I2C_STRESS_TASKS];
+static xStressReq xStressISR;
+static unsigned portLONG ulStressTicks;
+
+/*******************
+ * vStartI2CStress *
+ *******************
+ * Start the stress submitters
+ * - task 0 runs at tskIDLE_PRIORITY + 1, the others at the top priorities
+ * - the tick hook submitter starts with the first tick
+ */
+void vStartI2CStress( void )
+{
+	xStressTask *pxTask;
+	unsigned portBASE_TYPE uxPriority;
+	unsigned portBASE_TYPE i;
+	unsigned portBASE_TYPE j;
+
+	for (i = 0; i < I2C_STRESS_TASKS; i++) {
+		pxTask = &xStressTasks[i];
+		pxTask->pxSource = &xI2C_Stress.xSource[i];
+		vI2C_SignalInit(&pxTask->xSignal);
+
+		for (j = 0; j < I2C_STRESS_DEPTH; j++) {
+			prvStress_Fill(&pxTask->xReq[j], (unsigned portCHAR) (stressREQID + i));
+			pxTask->xReq[j].xI2C.pxHandle = &pxTask->xSignal;
+		}
+
+		if (i == 0) {
+			uxPriority = tskIDLE_PRIORITY + 1;
+		}
+		else {
+			uxPriority = configMAX_PRIORITIES - I2C_STRESS_TASKS + i;
+		}
+
+		xTaskCreate( prvStress_Task, (const signed portCHAR*)"I2CS", stressSTACK_SIZE, (void *) pxTask, uxPriority, ( xTaskHandle * ) NULL );
+	}
+
+	/* The tick hook request completes through its handler only */
+	prvStress_Fill(&xStressISR, (unsigned portCHAR) (stressREQID + I2C_STRESS_TASKS));
+	xStressISR.xI2C.ucPriority = (unsigned portCHAR) (configMAX_PRIORITIES - 1);
+
+} /*end vStartI2CStress */
+
+/******************
+ * prvStress_Fill *
+ ******************
+ * Set up a stress request descriptor
+ */
+static void prvStress_Fill( xStressReq *pxReq, unsigned portCHAR reqID )
+{
+	pxReq->xI2C.reqID		= reqID;
+	pxReq->xI2C.flags		= 0;
+	pxReq->xI2C.pxHandle	= NULL;
+	pxReq->xI2C.opcode		= I2C_ReadByte;
+	pxReq->xI2C.addr		= I2C_STRESS_ADDR;
+	pxReq->xI2C.comm		= I2C_STRESS_COMM;
+	pxReq->xI2C.pxPrepared	= NULL;
+	pxReq->xI2C.pxComplete	= prvStress_Done;
+	pxReq->xI2C.pvContext	= pxReq;
+
+} /*end prvStress_Fill */
+
+/******************
+ * prvStress_Task *
+ ******************
+ * Submit I2C_STRESS_DEPTH requests back to back, then collect each one
+ * - every other round sleeps a tick, so the low priority submitter is also
+ *   preempted part way through its submissions
+ */
+static void prvStress_Task( void *pvParameters )
+{
+	xStressTask *pxTask = (xStressTask *) pvParameters;
+	xStressReq *pxReq;
+	unsigned portLONG ulRound = 0;
+	unsigned portBASE_TYPE j;
+
+	for(;;){
+
+		for (j = 0; j < I2C_STRESS_DEPTH; j++) {
+			pxReq = &pxTask->xReq[j];
+			pxReq->ucCompletions = 0;
+			pxReq->ucBusy = pdTRUE;
+			pxTask->pxSource->ulSubmitted++;
+			ucI2C_SubmitWait(&pxReq->xI2C, portMAX_DELAY);
+		}
+
+		for (j = 0; j < I2C_STRESS_DEPTH; j++) {
+			pxReq = &pxTask->xReq[j];
+
+			if (ucI2C_Wait(&pxReq->xI2C, I2C_STRESS_TIMEOUT) == pdFALSE) {
+				pxTask->pxSource->ulStranded++;
+				ucI2C_Wait(&pxReq->xI2C, portMAX_DELAY);
+			}
+
+			if (pxReq->ucCompletions == 0) {
+				pxTask->pxSource->ulLost++;
+			}
+			else {
+				pxTask->pxSource->ulCompleted++;
+			}
+
+			pxReq->ucBusy = pdFALSE;
+		}
+
+		vTaskDelay((portTickType) (ulRound++ & 0x01));
+	}
+
+} /*end prvStress_Task */
+
+/******************
+ * prvStress_Done *
+ ******************
+ * Completion handler of every stress request (engine context)
+ * - a tick hook request is kept (pdTRUE): it has no waiter
+ */
+static portBASE_TYPE prvStress_Done( xI2C_struct *pxI2C )
+{
+	xStressReq *pxReq = (xStressReq *) pxI2C->pvContext;
+
+	xI2C_Stress.ulCompletions++;
+
+	if ((pxReq->ucBusy == pdFALSE) || (pxReq->ucCompletions != 0)) {
+		xI2C_Stress.ulDuplicate++;
+	}
+	pxReq->ucCompletions++;
+
+	if (pxI2C->status != I2C_STOP) {
+		xI2C_Stress.ulErrors++;
+	}
+
+	if (pxReq == &xStressISR) {
+		xI2C_Stress.xSource[stressISR].ulCompleted++;
+		pxReq->ucBusy = pdFALSE;
+		return pdTRUE;
+	}
+
+	return pdFALSE;
+
+} /*end prvStress_Done */
+
+/************************
+ * vApplicationTickHook *
+ ************************
+ * Interrupt submitter (configUSE_TICK_HOOK = 1 in the stress build)
+ * - submits xStressISR every I2C_STRESS_ISR_TICKS ticks once it is back,
+ *   preempting the submitter tasks (and the engine) at arbitrary points
+ * - counts it stranded once if it is not back in I2C_STRESS_TIMEOUT ticks
+ */
+void vApplicationTickHook( void )
+{
+	ulStressTicks++;
+
+	if (xStressISR.ucBusy) {
+		if (ulStressTicks == I2C_STRESS_TIMEOUT) {
+			xI2C_Stress.xSource[stressISR].ulStranded++;
+		}
+		return;
+	}
+
+	if (ulStressTicks < I2C_STRESS_ISR_TICKS) {
+		return;
+	}
+
+	ulStressTicks = 0;
+	xStressISR.ucCompletions = 0;
+	xStressISR.ucBusy = pdTRUE;
+	xI2C_Stress.xSource[stressISR].ulSubmitted++;
+	ucI2C_SubmitFromISR(&xStressISR.xI2C);
+
+} /*end vApplicationTickHook */
@@ -9,6 +9,9 @@
 /* Project specific includes */
 #include "led.h"
 #include "i2c.h"
+#include "i2cStress.h"
+#include "cam.h"
+#include "cycles.h"
 
 /* GPIO pin initialization for the NXP LPC2103
  *
@@ -77,13 +80,30 @@
 #define mainMAM_TIM_4		( ( unsigned portCHAR ) 0x03 )
 #define mainMAM_MODE_FULL	( ( unsigned portCHAR ) 0x02 )
 
-/* Define task priorites */
+/* Define task priorites
+ * - the I2C engine never runs below this priority: work raised from
+ *   interrupts (VSYNC register batches, watchdog recovery, SMBALERT# and
+ *   Host Notify) cannot lend it a task's priority, so it must stay above
+ *   the camera task; requesting tasks above it lend it their priority
+ */
 #define mainI2C_TASK_PRIORITY		( tskIDLE_PRIORITY + 3 )
 #define mainLED_TASK_PRIORITY		( tskIDLE_PRIORITY + 1 )
 #define mainCAM_TASK_PRIORITY		( tskIDLE_PRIORITY + 2 )
+#define mainAE_TASK_PRIORITY		( tskIDLE_PRIORITY + 1 )
 
 /* Function prototypes */
 static void prvSetupHardware( void );
+void vApplicationIdleHook( void );
+
+/* Idle mode accounting (see vApplicationIdleHook)
+ * - ulIdleSleeps counts the entries into Idle mode
+ * - ulIdleCycles accumulates the Pclk cycles spent in Idle mode, i.e. with
+ *   the CPU clock stopped; compare against elapsed time for the saving
+ * - ulIdleMaxCycles is the longest single sleep (bounded by the 1 ms tick)
+ */
+unsigned portLONG ulIdleSleeps;
+unsigned portLONG ulIdleCycles;
+unsigned portLONG ulIdleMaxCycles;
 
 /********
  * MAIN *
@@ -104,13 +124,13 @@ int main( void )
 	 */
 	prvSetupHardware();
 
-	/* Initialize I2C0
-	 * - parameter specifies the number of queue entries
-	 */
-	vI2C_Init((unsigned portBASE_TYPE) 0x1);
+	/* Initialize I2C0 */
+	vI2C_Init();
 
+#if I2C_STRESS == 0
 	/* Initialize CAM (the camera) */
 	vCAM_Init();
+#endif
 
 	/* Start tasks
 	 *
@@ -118,7 +138,15 @@ int main( void )
 	 */
 	vStartI2CTask ( mainI2C_TASK_PRIORITY );
 	vStartLEDTask ( mainLED_TASK_PRIORITY );
+#if I2C_STRESS == 1
+	/* The I2C submission stress test takes the camera's place (the
+	 * camera sources are not linked, see Makefile)
+	 */
+	vStartI2CStress();
+#else
 	vStartCAMTask ( mainCAM_TASK_PRIORITY );
+	vStartAETask ( mainAE_TASK_PRIORITY );
+#endif
 
 	/* Start the FreeRTOS scheduler
 	 *
@@ -191,3 +219,39 @@ static void prvSetupHardware( void )
 
 	/* The LPC2103 should now be running at 58.9824 MHz */
 }
+
+/**************************
+ * vApplicationIdleHook() *
+ **************************
+ * Called repeatedly by the FreeRTOS idle task (configUSE_IDLE_HOOK = 1)
+ *
+ * Put the CPU into Idle mode (PCON[0] = 1) until the next interrupt. The
+ * CPU clock stops but peripherals keep running, so the tick (Timer0) or any
+ * other enabled interrupt wakes the CPU within one tick.
+ *
+ * Interrupts are masked around the sleep so that the time spent asleep is
+ * measured before the waking interrupt is serviced (and before it can
+ * switch to another task). The masked interrupt still terminates Idle mode
+ * and is serviced as soon as the critical section is left.
+ *
+ * NOTE: This function MUST NOT block (see tasks.c).
+ */
+void vApplicationIdleHook( void )
+{
+	unsigned portLONG ulStart;
+	unsigned portLONG ulCycles;
+
+	portENTER_CRITICAL();
+
+	ulStart = ulCYCLES_NOW();
+	WRITE(PCON, 0x01);
+	ulCycles = ulCyclesSince(ulStart);
+
+	portEXIT_CRITICAL();
+
+	ulIdleSleeps++;
+	ulIdleCycles += ulCycles;
+	if (ulCycles > ulIdleMaxCycles) {
+		ulIdleMaxCycles = ulCycles;
+	}
+}
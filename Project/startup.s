@@ -81,11 +81,20 @@
  * - ABORT:			Data abort OR instruction prefetch abort exception
  * - SYSTEM:		Privelaged mode used by FreeRTOS tasks
  * - UNDEFINED:		Undefined instruction exception
+ *
+ * NOTE: LPC2103-rom.ld checks that .data + .bss end below these stacks
+ *       (__mode_stacks__ = their total); update it if a size changes
+ *
+ * IRQ_STACK_SIZE: IRQs do not nest, so the IRQ stack holds the deepest
+ * single handler chain. By -fstack-usage (-O0) that is vCAM_ISR ->
+ * vCAM_SyncFlush -> ucI2C_SubmitFromISR -> prvI2C_Enqueue -> pvI2C_Swap,
+ * 216 bytes; the tick hook chain of the I2C_STRESS build is 184 bytes.
+ * Re-check it when an ISR gains calls.
  */
  	.set	UND_STACK_SIZE,	0x00000004
 	.set	ABT_STACK_SIZE,	0x00000004
 	.set	FIQ_STACK_SIZE,	0x00000080
-	.set	IRQ_STACK_SIZE,	0x00000080
+	.set	IRQ_STACK_SIZE,	0x00000140
 	.set	SVC_STACK_SIZE,	0x00000080
 
 /* ARM CPU Mode bit defines - used in CPSR */